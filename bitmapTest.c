@@ -0,0 +1,129 @@
+// bitmapTest - A program that performs some bitmap processing.
+//
+// This program is an example use of the image1bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// João Manuel Rodrigues <jmr@ua.pt>
+// 2023
+
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "image1bit.h"
+
+static const char* USAGE =
+    "USAGE: bitmapTest [FILE...] [OPERATION [OPERAND...]]\n"
+    "  Bitmaps are kept in a stack, as in imageTool: FILE (a PBM file) is\n"
+    "  loaded into a new bitmap CURR, the previous one is PRED.\n"
+    "OPERATIONS:\n"
+    "  save FILE       save CURR to FILE\n"
+    "  info            print size and number of set (black) pixels of CURR\n"
+    "  and             CURR = CURR AND PRED\n"
+    "  or              CURR = CURR OR PRED\n"
+    "  xor             CURR = CURR XOR PRED\n"
+    "  not             invert CURR\n"
+    "  crop X,Y,W,H    crop CURR into a new bitmap\n"
+    "  paste X,Y       paste PRED into CURR at (X,Y)\n"
+    "  locate          search PRED in CURR, print matching position, or NOTFOUND\n"
+    ;
+
+static char* errors[] = {
+  "Success",
+  "Insufficient operands",
+  "Insufficient bitmaps",
+  "Bitmap buffer is full",
+  "Image1bit failure: %s",
+  "Invalid operand",
+  "Invalid rect",
+  "Bitmaps differ in size",
+};
+
+// The operations are checked here, not by the module: bitmaps of the
+// wrong size or rects outside CURR are reported as errors.
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();   // selects the vector code used by the bitmap operations
+
+  const int N = 10;   // size of the stack
+  Bitmap bmp[N];
+  int n = 0;          // number of bitmaps in the stack
+  int x, y, w, h;
+  int err = 0;
+
+  int k;
+  for (k = 1; k < ac; k++) {
+    if (strcmp(av[k], "save") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Saving B%d -> %s\n", n-1, av[k]);
+      if (!BitmapSave(bmp[n-1], av[k])) { err = 4; break; }
+    } else if (strcmp(av[k], "info") == 0) {
+      if (n < 1) { err = 2; break; }
+      printf("# Size: %dx%d\n", BitmapWidth(bmp[n-1]), BitmapHeight(bmp[n-1]));
+      printf("# Count: %" PRIu64 "\n", BitmapCount(bmp[n-1]));
+    } else if (strcmp(av[k], "and") == 0 || strcmp(av[k], "or") == 0 ||
+               strcmp(av[k], "xor") == 0) {
+      if (n < 2) { err = 2; break; }
+      if (BitmapWidth(bmp[n-1]) != BitmapWidth(bmp[n-2]) ||
+          BitmapHeight(bmp[n-1]) != BitmapHeight(bmp[n-2])) { err = 7; break; }
+      fprintf(stderr, "B%d %s B%d\n", n-1, av[k], n-2);
+      if (av[k][0] == 'a') BitmapAnd(bmp[n-1], bmp[n-2]);
+      else if (av[k][0] == 'o') BitmapOr(bmp[n-1], bmp[n-2]);
+      else BitmapXor(bmp[n-1], bmp[n-2]);
+    } else if (strcmp(av[k], "not") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Inverting B%d\n", n-1);
+      BitmapNot(bmp[n-1]);
+    } else if (strcmp(av[k], "crop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (x < 0 || y < 0 || w < 0 || h < 0 ||
+          w > BitmapWidth(bmp[n-1]) - x || h > BitmapHeight(bmp[n-1]) - y) { err = 6; break; }
+      fprintf(stderr, "Cropping B%d (%d,%d,%d,%d) -> B%d\n", n-1, x, y, w, h, n);
+      bmp[n] = BitmapCrop(bmp[n-1], x, y, w, h);
+      if (bmp[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "paste") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = BitmapWidth(bmp[n-2]);
+      h = BitmapHeight(bmp[n-2]);
+      if (x < 0 || y < 0 ||
+          w > BitmapWidth(bmp[n-1]) - x || h > BitmapHeight(bmp[n-1]) - y) { err = 6; break; }
+      fprintf(stderr, "Pasting B%d at B%d (%d,%d)\n", n-2, n-1, x, y);
+      BitmapPaste(bmp[n-1], x, y, bmp[n-2]);
+    } else if (strcmp(av[k], "locate") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating B%d in B%d\n", n-2, n-1);
+      if (BitmapLocate(bmp[n-1], &x, &y, bmp[n-2])) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else {
+      // Anything else is a file to load
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Loading %s -> B%d\n", av[k], n);
+      bmp[n] = BitmapLoad(av[k]);
+      if (bmp[n] == NULL) { err = 4; break; }
+      n++;
+    }
+  }
+
+  while (n > 0) BitmapDestroy(&bmp[--n]);   // preserves errno
+  error(0, errno, errors[err], BitmapErrMsg());
+  return err;
+}
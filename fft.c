@@ -0,0 +1,227 @@
+/// fft - Fast Fourier transforms of 2D complex arrays.
+///
+/// See fft.h for usage.
+///
+/// Rows are transformed one at a time.  Columns are transformed all
+/// together: each butterfly combines two chunks of rows, so the inner loops
+/// run over contiguous memory, and 3 stages are done on each chunk while it
+/// is in cache.  The butterflies are vectorized (simd.h).
+/// Rows are padded (see FFTStride) so that the rows combined by the
+/// butterflies, a power of two apart, do not compete for the same cache sets.
+
+#include "fft.h"
+#include "simd.h"
+#include <math.h>
+#include <stdlib.h>
+
+// Twiddle factors and bit-reversal table for one dimension
+struct fftdim {
+  int n;
+  double* cs;   // cs[k] = cos(2 pi k / n), k < n/2
+  double* sn;   // sn[k] = sin(2 pi k / n), k < n/2
+  double* tr;   // tr[len/2 + k] = cos(2 pi k / len), k < len/2, for each stage len
+  double* ti;   // ti[len/2 + k] = sin(2 pi k / len)
+  int* rev;     // rev[k] = k with its log2(n) bits reversed
+};
+
+struct fftplan {
+  struct fftdim x, y;
+  int stride;   // distance between rows of the arrays, in values
+};
+
+// Padding of each row (one cache line of doubles)
+#define PAD 8
+
+// Width of the chunks of rows combined by the column transforms (values)
+#define CHUNK 256
+
+/// Smallest power of two >= n.
+int FFTSize(int n) { ///
+  int p = 1;
+  while (p < n) p *= 2;
+  return p;
+}
+
+static int dimInit(struct fftdim* d, int n) {
+  int half = n / 2 > 0 ? n / 2 : 1;
+  d->n = n;
+  d->cs = malloc(half * sizeof(double));
+  d->sn = malloc(half * sizeof(double));
+  d->tr = malloc(n * sizeof(double));
+  d->ti = malloc(n * sizeof(double));
+  d->rev = malloc(n * sizeof(int));
+  if (d->cs == NULL || d->sn == NULL || d->tr == NULL || d->ti == NULL || d->rev == NULL) return 0;
+  for (int k = 0; k < n / 2; k++) {
+    d->cs[k] = cos(2.0 * M_PI * k / n);
+    d->sn[k] = sin(2.0 * M_PI * k / n);
+  }
+  // Contiguous twiddle factors of each stage, for fftRow
+  for (int len = 2; len <= n; len *= 2) {
+    for (int k = 0; k < len / 2; k++) {
+      d->tr[len / 2 + k] = d->cs[k * (n / len)];
+      d->ti[len / 2 + k] = d->sn[k * (n / len)];
+    }
+  }
+  int bits = 0;
+  while ((1 << bits) < n) bits++;
+  for (int k = 0; k < n; k++) {
+    int r = 0;
+    for (int b = 0; b < bits; b++) {
+      if (k & (1 << b)) r |= 1 << (bits - 1 - b);
+    }
+    d->rev[k] = r;
+  }
+  return 1;
+}
+
+static void dimFree(struct fftdim* d) {
+  free(d->cs);
+  free(d->sn);
+  free(d->tr);
+  free(d->ti);
+  free(d->rev);
+}
+
+/// Create a plan for transforms of ny rows of nx complex values.
+FFTPlan FFTCreate(int nx, int ny) { ///
+  FFTPlan p = calloc(1, sizeof(struct fftplan));
+  if (p == NULL) return NULL;
+  if (!dimInit(&p->x, nx) || !dimInit(&p->y, ny)) {
+    FFTDestroy(&p);
+    return NULL;
+  }
+  p->stride = (nx >= 64 && ny > 1) ? nx + PAD : nx;
+  return p;
+}
+
+/// Distance between rows of the arrays transformed with plan p.
+int FFTStride(FFTPlan p) { ///
+  return p->stride;
+}
+
+/// Destroy the plan pointed to by (*pp).
+void FFTDestroy(FFTPlan* pp) { ///
+  if (*pp != NULL) {
+    dimFree(&(*pp)->x);
+    dimFree(&(*pp)->y);
+    free(*pp);
+    *pp = NULL;
+  }
+}
+
+// Transform one row of n values in place
+static void fftRow(const struct fftdim* d, double* re, double* im, double dir) {
+  int n = d->n;
+  for (int k = 0; k < n; k++) {
+    int r = d->rev[k];
+    if (k < r) {
+      double t = re[k]; re[k] = re[r]; re[r] = t;
+      t = im[k]; im[k] = im[r]; im[r] = t;
+    }
+  }
+  // First stage: twiddle factor 1
+  for (int a = 0; a + 1 < n; a += 2) {
+    double tr = re[a + 1], ti = im[a + 1];
+    re[a + 1] = re[a] - tr;
+    im[a + 1] = im[a] - ti;
+    re[a] += tr;
+    im[a] += ti;
+  }
+  // Short stages (up to 8 values) inline: calls would cost more than the work
+  int len = 4;
+  for (; len <= n && len <= 8; len *= 2) {
+    int half = len / 2;
+    for (int s = 0; s < n; s += len) {
+      for (int k = 0; k < half; k++) {
+        double c = d->tr[half + k], sn = dir * d->ti[half + k];
+        int a = s + k, b = a + half;
+        double tr = re[b] * c - im[b] * sn;
+        double ti = re[b] * sn + im[b] * c;
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+  for (; len <= n; len *= 2) {
+    int half = len / 2;
+    for (int s = 0; s < n; s += len) {
+      SimdButterfly(re + s, im + s, re + s + half, im + s + half, half, d->tr + half, d->ti + half, 1, dir);
+    }
+  }
+}
+
+// Transform the columns of ny rows of nx values in place (rows stride apart).
+static void fftColumns(const struct fftdim* d, double* re, double* im, int nx, size_t stride, double dir) {
+  int n = d->n;
+  for (int k = 0; k < n; k++) {
+    int r = d->rev[k];
+    if (k < r) {
+      double* a = re + (size_t)k * stride;
+      double* b = re + (size_t)r * stride;
+      double* c = im + (size_t)k * stride;
+      double* e = im + (size_t)r * stride;
+      for (int x = 0; x < nx; x++) {
+        double t = a[x]; a[x] = b[x]; b[x] = t;
+        t = c[x]; c[x] = e[x]; e[x] = t;
+      }
+    }
+  }
+  // Stages in groups of up to 3 (lengths len, 2len, 4len): for each k,
+  // the 8 rows s+k+j*len/2 (j < 8) are combined only among themselves,
+  // so all 3 stages are done on a chunk of those rows while it is in cache
+  // (one pass over the array per group, instead of one per stage).
+  for (int len = 2; len <= n; len *= 8) {
+    int half = len / 2;
+    int g = (len * 2 > n) ? 1 : (len * 4 > n) ? 2 : 3;   // stages in the group
+    int span = len << (g - 1);
+    for (int s = 0; s < n; s += span) {
+      for (int k = 0; k < half; k++) {
+        double* r = re + (size_t)(s + k) * stride;
+        double* i = im + (size_t)(s + k) * stride;
+        for (int x = 0; x < nx; x += CHUNK) {
+          int m = nx - x < CHUNK ? nx - x : CHUNK;
+          for (int t = 0; t < g; t++) {
+            int step = n / (len << t);
+            for (int j = 0; j < (1 << g); j++) {
+              if (j & (1 << t)) continue;
+              size_t a = (size_t)j * half * stride + x;
+              size_t b = a + ((size_t)half << t) * stride;
+              int w = (k + (j & ((1 << t) - 1)) * half) * step;
+              SimdButterfly(r + a, i + a, r + b, i + b, m, d->cs + w, d->sn + w, 0, dir);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/// In-place 2D transform of the array (re, im) of ny rows of nx values.
+void FFT2D(FFTPlan p, double* re, double* im, int dir, int rows) { ///
+  size_t stride = p->stride;
+  if (dir < 0) {
+    // Rows first: rows known to be zero stay zero
+    for (int y = 0; y < rows; y++) {
+      FFTRow(p, re + y * stride, im + y * stride, -1);
+    }
+    FFTColumns(p, re, im, -1);
+  } else {
+    // Columns first: then only the rows wanted need a row transform
+    FFTColumns(p, re, im, 1);
+    for (int y = 0; y < rows; y++) {
+      FFTRow(p, re + y * stride, im + y * stride, 1);
+    }
+  }
+}
+
+/// In-place transform of one row of nx values (re, im).
+void FFTRow(FFTPlan p, double* re, double* im, int dir) { ///
+  fftRow(&p->x, re, im, dir);
+}
+
+/// In-place transform of the columns of the array (re, im) of ny rows.
+void FFTColumns(FFTPlan p, double* re, double* im, int dir) { ///
+  fftColumns(&p->y, re, im, p->x.n, p->stride, dir);
+}
@@ -0,0 +1,68 @@
+/// fft - Fast Fourier transforms of 2D complex arrays.
+///
+/// Used internally by the image8bit module (ImageMatchNCC) to compute
+/// correlations in O(N log N).
+/// Self-contained: iterative radix-2 transforms on arrays of doubles, with
+/// real and imaginary parts in separate arrays.
+///
+/// Use as follows:
+///
+/// FFTPlan p = FFTCreate(nx, ny);    // nx, ny: powers of two
+/// // re, im: ny rows of FFTStride(p) values (nx used)
+/// FFT2D(p, re, im, -1, ny);         // forward transform of ny rows of nx values
+/// ...                               // multiply spectra
+/// FFT2D(p, re, im, +1, ny);         // inverse transform (not scaled)
+/// // (or the same, row by row, with FFTRow and FFTColumns)
+/// FFTDestroy(&p);
+
+#ifndef FFT_H
+#define FFT_H
+
+/// A plan: sizes and twiddle factors for transforms of one size.
+typedef struct fftplan* FFTPlan;
+
+/// Smallest power of two >= n.
+/// Requires: 0 < n <= 2^30.
+int FFTSize(int n) ;
+
+/// Create a plan for transforms of ny rows of nx complex values.
+/// Requires: nx and ny are powers of two.
+/// On success, returns a new plan (destroy with FFTDestroy).
+/// On failure (memory), returns NULL.
+FFTPlan FFTCreate(int nx, int ny) ;
+
+/// Destroy the plan pointed to by (*pp).
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void FFTDestroy(FFTPlan* pp) ;
+
+/// Distance between consecutive rows of the arrays transformed with plan p,
+/// in values.  Rows are padded beyond nx values when that avoids cache
+/// conflicts between rows a power of two apart.
+int FFTStride(FFTPlan p) ;
+
+/// In-place 2D transform of the array (re, im) of ny rows of nx values
+/// (element (x, y) at index y*FFTStride(p) + x; padding is ignored).
+///   dir : -1 for the forward transform, +1 for the inverse transform
+///         (which is not divided by nx*ny).
+///   rows : for the forward transform, only rows [0, rows) of the input
+///          may be nonzero (the others must be zero);
+///          for the inverse transform, only rows [0, rows) of the output
+///          are computed (the others are left with garbage).
+void FFT2D(FFTPlan p, double* re, double* im, int dir, int rows) ;
+
+/// The two halves of FFT2D, for callers that work on each row while it is
+/// in cache (loading it before the forward transform, or using it after the
+/// inverse one):
+///   forward: FFTRow on each nonzero row, then FFTColumns;
+///   inverse: FFTColumns, then FFTRow on each row wanted.
+
+/// In-place transform of one row of nx values (re, im).
+///   dir : -1 forward, +1 inverse (not divided by nx).
+void FFTRow(FFTPlan p, double* re, double* im, int dir) ;
+
+/// In-place transform of the columns of the array (re, im) of ny rows.
+///   dir : -1 forward, +1 inverse (not divided by ny).
+void FFTColumns(FFTPlan p, double* re, double* im, int dir) ;
+
+#endif
@@ -0,0 +1,402 @@
+/// image1bit - Packed bilevel (1-bit) images.
+///
+/// See image1bit.h for usage.
+///
+/// Pixels are stored as in PBM files: 8 per byte, the leftmost pixel of
+/// each byte in its most significant bit.  Each row is padded to a whole
+/// number of 64-bit words, and the padding bits are always clear, so
+/// whole-bitmap operations (bitwise operations, counting) may work on
+/// words without special cases.  Operations at arbitrary pixel offsets
+/// (crop, paste, locate) load words in big-endian order, so that pixel
+/// order matches bit order and a shift moves pixels left or right.
+
+#include "image1bit.h"
+#include "simd.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The data structure
+//
+// A bitmap is stored in a structure containing 3 fields:
+// Two integers store the bitmap width and height.
+// The other field is a pointer to an array of 64-bit words, holding
+// height rows of stride words each.
+
+struct bitmap {
+  int width;
+  int height;
+  size_t stride;    // words per row: (width+63)/64
+  uint64_t* words;  // pixel data, padding bits clear
+};
+
+// Address of the first byte of row y
+#define ROW(bmp, y) ((uint8_t*)((bmp)->words + (size_t)(y) * (bmp)->stride))
+
+// Load and store the 64 pixels of a word, the leftmost in the most significant bit
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BIGENDIAN(w) __builtin_bswap64(w)
+#else
+#define BIGENDIAN(w) (w)
+#endif
+
+static inline uint64_t load64(const uint8_t* p) {
+  uint64_t w;
+  memcpy(&w, p, 8);
+  return BIGENDIAN(w);
+}
+
+static inline void store64(uint8_t* p, uint64_t w) {
+  w = BIGENDIAN(w);
+  memcpy(p, &w, 8);
+}
+
+// Word with the n leftmost pixels set (0 < n <= 64)
+static inline uint64_t leftMask(int n) {
+  return n >= 64 ? ~(uint64_t)0 : ~(~(uint64_t)0 >> n);
+}
+
+// The 64 pixels of a row of words words starting at pixel x
+// (pixels beyond the row read as clear).
+static inline uint64_t getBits(const uint8_t* row, size_t words, size_t x) {
+  size_t i = x / 64;
+  unsigned s = x % 64;
+  uint64_t w = load64(row + 8 * i) << s;
+  if (s != 0 && i + 1 < words) w |= load64(row + 8 * (i + 1)) >> (64 - s);
+  return w;
+}
+
+// Replace the n pixels of a row starting at pixel x by the n leftmost
+// pixels of v (whose other pixels are clear).
+static inline void putBits(uint8_t* row, size_t x, uint64_t v, int n) {
+  size_t i = x / 64;
+  unsigned s = x % 64;
+  uint64_t m = leftMask(n);
+  store64(row + 8 * i, (load64(row + 8 * i) & ~(m >> s)) | (v >> s));
+  if (s + n > 64) {
+    store64(row + 8 * (i + 1), (load64(row + 8 * (i + 1)) & ~(m << (64 - s))) | (v << (64 - s)));
+  }
+}
+
+
+/// Error handling functions
+
+// As in the image8bit module: functions dealing with memory allocation or
+// file (I/O) operations set errCause (and preserve or set errno) on failure.
+
+// Variable to preserve errno temporarily
+static int errsave = 0;
+
+// Error cause
+static char* errCause;
+
+/// Return a string with the cause of the last failure.
+char* BitmapErrMsg(void) { ///
+  return errCause;
+}
+
+// Check a condition and set errCause to failmsg in case of failure.
+// Propagates the condition.
+// Preserves global errno!
+static int check(int condition, const char* failmsg) {
+  errCause = (char*)(condition ? "" : failmsg);
+  return condition;
+}
+
+
+/// Bitmap management functions
+
+/// Create a new bitmap with all pixels clear (white).
+Bitmap BitmapCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  Bitmap bmp = malloc(sizeof(struct bitmap));
+  if (bmp == NULL) {
+    errCause = "Memory allocation failed";
+    errno = 12;
+    return NULL;
+  }
+  bmp->width = width;
+  bmp->height = height;
+  bmp->stride = ((size_t)width + 63) / 64;
+  // One word at least, so that a null size is never requested
+  bmp->words = calloc(bmp->stride * height + 1, sizeof(uint64_t));
+  if (bmp->words == NULL) {
+    errCause = "Memory allocation failed";
+    errno = 12;
+    free(bmp);
+    return NULL;
+  }
+  return bmp;
+}
+
+/// Destroy the bitmap pointed to by (*bmpp).
+void BitmapDestroy(Bitmap* bmpp) { ///
+  assert (bmpp != NULL);
+  if (*bmpp != NULL) {
+    free((*bmpp)->words);
+    free(*bmpp);
+    *bmpp = NULL;
+  }
+}
+
+
+/// PBM file operations
+
+// Match and skip 0 or more comment lines in file f.
+// Comments start with a # and continue until the end-of-line, inclusive.
+// Returns the number of comments skipped.
+static int skipComments(FILE* f) {
+  char c;
+  int i = 0;
+  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
+    i++;
+  }
+  return i;
+}
+
+/// Load a raw PBM file (P4).
+Bitmap BitmapLoad(const char* filename) { ///
+  int w, h;
+  char c;
+  FILE* f = NULL;
+  Bitmap bmp = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PBM header
+  check( fscanf(f, "P%c ", &c) == 1 && c == '4' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", &h) == 1 && h >= 0 , "Invalid height" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  // Allocate bitmap
+  (bmp = BitmapCreate(w, h)) != NULL;
+
+  // Read pixels: (w+7)/8 bytes per row
+  size_t bytes = ((size_t)w + 7) / 8;
+  for (int y = 0; success && y < h; y++) {
+    uint8_t* row = ROW(bmp, y);
+    success = check( fread(row, 1, bytes, f) == bytes, "Reading pixels" );
+    if (w % 8 != 0) row[bytes - 1] &= (uint8_t)(0xFF00 >> (w % 8));  // clear padding
+  }
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    BitmapDestroy(&bmp);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return bmp;
+}
+
+/// Save bitmap to raw PBM file (P4).
+int BitmapSave(Bitmap bmp, const char* filename) { ///
+  assert (bmp != NULL);
+  FILE* f = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P4\n%d %d\n", bmp->width, bmp->height) > 0, "Writing header failed" );
+
+  size_t bytes = ((size_t)bmp->width + 7) / 8;
+  for (int y = 0; success && y < bmp->height; y++) {
+    success = check( fwrite(ROW(bmp, y), 1, bytes, f) == bytes, "Writing pixels failed" );
+  }
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+
+/// Information queries
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bmp) { ///
+  assert (bmp != NULL);
+  return bmp->width;
+}
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bmp) { ///
+  assert (bmp != NULL);
+  return bmp->height;
+}
+
+/// Count the set (black) pixels.
+/// Padding bits are clear, so the whole array is counted at once.
+uint64_t BitmapCount(Bitmap bmp) { ///
+  assert (bmp != NULL);
+  return SimdPopcount(bmp->words, bmp->stride * bmp->height);
+}
+
+
+/// Pixel get & set operations
+
+// Check if (x,y) is inside bmp
+static int validPos(Bitmap bmp, int x, int y) {
+  return 0 <= x && x < bmp->width && 0 <= y && y < bmp->height;
+}
+
+/// Get the pixel at position (x,y).
+int BitmapGetPixel(Bitmap bmp, int x, int y) { ///
+  assert (bmp != NULL);
+  assert (validPos(bmp, x, y));
+  return (ROW(bmp, y)[x / 8] >> (7 - x % 8)) & 1;
+}
+
+/// Set or clear the pixel at position (x,y).
+void BitmapSetPixel(Bitmap bmp, int x, int y, int bit) { ///
+  assert (bmp != NULL);
+  assert (validPos(bmp, x, y));
+  uint8_t* p = ROW(bmp, y) + x / 8;
+  uint8_t m = (uint8_t)(0x80 >> (x % 8));
+  *p = bit ? (*p | m) : (*p & ~m);
+}
+
+/// Set row y of bmp from an array of 8-bit levels (set if level < thr).
+void BitmapPackRow(Bitmap bmp, int y, const uint8_t* levels, uint8_t thr) { ///
+  assert (bmp != NULL);
+  assert (0 <= y && y < bmp->height);
+  SimdPackBits(ROW(bmp, y), levels, bmp->width, thr);
+}
+
+/// Store row y of bmp into an array of 8-bit levels.
+void BitmapUnpackRow(Bitmap bmp, int y, uint8_t* levels, uint8_t black, uint8_t white) { ///
+  assert (bmp != NULL);
+  assert (0 <= y && y < bmp->height);
+  SimdUnpackBits(levels, ROW(bmp, y), bmp->width, black, white);
+}
+
+
+/// Bitwise operations
+
+// These work on whole words, padding included (clear in both operands,
+// so it stays clear).
+
+/// bmp1 = bmp1 AND bmp2.
+void BitmapAnd(Bitmap bmp1, Bitmap bmp2) { ///
+  assert (bmp1 != NULL && bmp2 != NULL);
+  assert (bmp1->width == bmp2->width && bmp1->height == bmp2->height);
+  size_t n = bmp1->stride * bmp1->height;
+  for (size_t i = 0; i < n; i++)
+    bmp1->words[i] &= bmp2->words[i];
+}
+
+/// bmp1 = bmp1 OR bmp2.
+void BitmapOr(Bitmap bmp1, Bitmap bmp2) { ///
+  assert (bmp1 != NULL && bmp2 != NULL);
+  assert (bmp1->width == bmp2->width && bmp1->height == bmp2->height);
+  size_t n = bmp1->stride * bmp1->height;
+  for (size_t i = 0; i < n; i++)
+    bmp1->words[i] |= bmp2->words[i];
+}
+
+/// bmp1 = bmp1 XOR bmp2.
+void BitmapXor(Bitmap bmp1, Bitmap bmp2) { ///
+  assert (bmp1 != NULL && bmp2 != NULL);
+  assert (bmp1->width == bmp2->width && bmp1->height == bmp2->height);
+  size_t n = bmp1->stride * bmp1->height;
+  for (size_t i = 0; i < n; i++)
+    bmp1->words[i] ^= bmp2->words[i];
+}
+
+/// Invert every pixel of bmp.
+/// The padding of the last word of each row is cleared again.
+void BitmapNot(Bitmap bmp) { ///
+  assert (bmp != NULL);
+  size_t n = bmp->stride * bmp->height;
+  for (size_t i = 0; i < n; i++)
+    bmp->words[i] = ~bmp->words[i];
+  if (bmp->width % 64 != 0) {
+    uint64_t m = leftMask(bmp->width % 64);
+    for (int y = 0; y < bmp->height; y++) {
+      uint8_t* last = ROW(bmp, y) + 8 * (bmp->stride - 1);
+      store64(last, load64(last) & m);
+    }
+  }
+}
+
+
+/// Geometric operations
+
+/// Crop a rectangular subbitmap from bmp.
+/// Each word of the result is one (shifted) word load from bmp.
+Bitmap BitmapCrop(Bitmap bmp, int x, int y, int w, int h) { ///
+  assert (bmp != NULL);
+  assert (0 <= x && 0 <= w && x + w <= bmp->width);
+  assert (0 <= y && 0 <= h && y + h <= bmp->height);
+  Bitmap sub = BitmapCreate(w, h);
+  if (sub == NULL) return NULL;
+  for (int r = 0; r < h; r++) {
+    const uint8_t* src = ROW(bmp, y + r);
+    uint8_t* dst = ROW(sub, r);
+    for (size_t k = 0; k < sub->stride; k++) {
+      uint64_t v = getBits(src, bmp->stride, x + 64 * k);
+      if (64 * k + 64 > (size_t)w) v &= leftMask(w - 64 * k);
+      store64(dst + 8 * k, v);
+    }
+  }
+  return sub;
+}
+
+/// Paste bmp2 into position (x, y) of bmp1.
+void BitmapPaste(Bitmap bmp1, int x, int y, Bitmap bmp2) { ///
+  assert (bmp1 != NULL && bmp2 != NULL);
+  assert (0 <= x && x + bmp2->width <= bmp1->width);
+  assert (0 <= y && y + bmp2->height <= bmp1->height);
+  int w = bmp2->width;
+  for (int r = 0; r < bmp2->height; r++) {
+    const uint8_t* src = ROW(bmp2, r);
+    uint8_t* dst = ROW(bmp1, y + r);
+    for (size_t k = 0; k < bmp2->stride; k++) {
+      int n = w - 64 * k < 64 ? (int)(w - 64 * k) : 64;
+      putBits(dst, x + 64 * k, load64(src + 8 * k), n);
+    }
+  }
+}
+
+// Check if bmp2 matches the subbitmap of bmp1 at (x, y), 64 pixels at a time.
+static int matchSubBitmap(Bitmap bmp1, int x, int y, Bitmap bmp2) {
+  size_t last = bmp2->stride - 1;
+  uint64_t m = leftMask(bmp2->width - 64 * last);
+  for (int r = 0; r < bmp2->height; r++) {
+    const uint8_t* big = ROW(bmp1, y + r);
+    const uint8_t* small = ROW(bmp2, r);
+    for (size_t k = 0; k < last; k++) {
+      if (getBits(big, bmp1->stride, x + 64 * k) != load64(small + 8 * k)) return 0;
+    }
+    if ((getBits(big, bmp1->stride, x + 64 * last) & m) != load64(small + 8 * last)) return 0;
+  }
+  return 1;
+}
+
+/// Locate a subbitmap inside another bitmap.
+int BitmapLocate(Bitmap bmp1, int* px, int* py, Bitmap bmp2) { ///
+  assert (bmp1 != NULL && bmp2 != NULL);
+  assert (px != NULL && py != NULL);
+  int w = bmp2->width, h = bmp2->height;
+  if (w > bmp1->width || h > bmp1->height) return 0;
+  if (w == 0 || h == 0) {   // an empty bitmap matches anywhere
+    *px = 0;
+    *py = 0;
+    return 1;
+  }
+  for (int y = 0; y + h <= bmp1->height; y++) {
+    for (int x = 0; x + w <= bmp1->width; x++) {
+      if (matchSubBitmap(bmp1, x, y, bmp2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
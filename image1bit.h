@@ -0,0 +1,142 @@
+/// image1bit - Packed bilevel (1-bit) images.
+///
+/// A bitmap stores one bit per pixel, 8 pixels per byte: 8 times less
+/// memory and bandwidth than an 8-bit image whose pixels are all either
+/// black or white (such as the result of ImageThreshold).
+/// Set pixels (bit 1) are black, clear pixels (bit 0) are white, as in
+/// the PBM format.
+/// Whole-bitmap operations work on 64 pixels at a time.
+///
+/// See image8bit.h for conversions between images and bitmaps
+/// (ImageToBitmap, ImageFromBitmap).
+
+#ifndef IMAGE1BIT_H
+#define IMAGE1BIT_H
+
+#include <inttypes.h>
+
+// Type Bitmap is a pointer to bitmap objects
+typedef struct bitmap *Bitmap;
+
+
+/// Error handling functions
+
+/// Functions that may fail (allocation or I/O) return NULL or 0, and set
+/// errno and an internal cause, as in the image8bit module.
+
+/// Return a string with the cause of the last failure.
+char* BitmapErrMsg(void) ;
+
+
+/// Bitmap management functions
+
+/// Create a new bitmap with all pixels clear (white).
+///   width, height : the dimensions of the new bitmap.
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapCreate(int width, int height) ;
+
+/// Destroy the bitmap pointed to by (*bmpp).
+///   bmpp : address of a Bitmap variable.
+/// If (*bmpp)==NULL, no operation is performed.
+/// Ensures: (*bmpp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void BitmapDestroy(Bitmap* bmpp) ;
+
+
+/// PBM file operations
+
+/// Load a raw PBM file (P4).
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapLoad(const char* filename) ;
+
+/// Save bitmap to raw PBM file (P4).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitmapSave(Bitmap bmp, const char* filename) ;
+
+
+/// Information queries
+
+/// Get bitmap width
+int BitmapWidth(Bitmap bmp) ;
+
+/// Get bitmap height
+int BitmapHeight(Bitmap bmp) ;
+
+/// Count the set (black) pixels.
+uint64_t BitmapCount(Bitmap bmp) ;
+
+
+/// Pixel get & set operations
+
+/// Get the pixel at position (x,y): 1 if set (black), 0 if clear (white).
+/// Requires: (x,y) is inside bmp.
+int BitmapGetPixel(Bitmap bmp, int x, int y) ;
+
+/// Set the pixel at position (x,y) if bit is nonzero, clear it otherwise.
+/// Requires: (x,y) is inside bmp.
+void BitmapSetPixel(Bitmap bmp, int x, int y, int bit) ;
+
+/// Set row y of bmp from an array of 8-bit levels:
+/// pixel x is set (black) if levels[x] < thr, and cleared otherwise,
+/// for x in [0, width).  (This is the rule of ImageThreshold.)
+/// Requires: y is a row of bmp.
+void BitmapPackRow(Bitmap bmp, int y, const uint8_t* levels, uint8_t thr) ;
+
+/// Store row y of bmp into an array of 8-bit levels:
+/// levels[x] becomes black if pixel x is set, white otherwise,
+/// for x in [0, width).
+/// Requires: y is a row of bmp.
+void BitmapUnpackRow(Bitmap bmp, int y, uint8_t* levels, uint8_t black, uint8_t white) ;
+
+
+/// Bitwise operations
+
+/// These modify bmp1 in-place, pixel by pixel: no allocation involved.
+/// Requires: bmp1 and bmp2 have the same size.
+
+/// bmp1 = bmp1 AND bmp2 (pixels black in both).
+void BitmapAnd(Bitmap bmp1, Bitmap bmp2) ;
+
+/// bmp1 = bmp1 OR bmp2 (pixels black in either).
+void BitmapOr(Bitmap bmp1, Bitmap bmp2) ;
+
+/// bmp1 = bmp1 XOR bmp2 (pixels that differ).
+void BitmapXor(Bitmap bmp1, Bitmap bmp2) ;
+
+/// Invert every pixel of bmp.
+void BitmapNot(Bitmap bmp) ;
+
+
+/// Geometric operations
+
+/// Crop a rectangular subbitmap from bmp.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires: the rectangle must be inside bmp.
+/// On success, a new bitmap is returned.
+/// (The caller is responsible for destroying the returned bitmap!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Bitmap BitmapCrop(Bitmap bmp, int x, int y, int w, int h) ;
+
+/// Paste bmp2 into position (x, y) of bmp1.
+/// This modifies bmp1 in-place: no allocation involved.
+/// Requires: bmp2 must fit inside bmp1 at position (x, y).
+void BitmapPaste(Bitmap bmp1, int x, int y, Bitmap bmp2) ;
+
+/// Locate a subbitmap inside another bitmap.
+/// Searches for bmp2 inside bmp1.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// The first match in raster order (top to bottom, left to right) is
+/// returned.  Only positions where bmp2 fits inside bmp1 are considered.
+int BitmapLocate(Bitmap bmp1, int* px, int* py, Bitmap bmp2) ;
+
+#endif
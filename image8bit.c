@@ -22,11 +22,22 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "instrumentation.h"
+#include "threadpool.h"
+#include "simd.h"
+#include "fft.h"
 #include <math.h>
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
 // The data structure
 //
 // An image is stored in a structure containing 3 fields:
@@ -35,9 +46,31 @@
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
 // top to bottom.
-// For example, in a 100-pixel wide image (img->width == 100),
+// Images obtained with ImageMap keep their pixel array inside a memory
+// mapping of the file (fields map and mapsize), which must be unmapped
+// instead of freed.
+// Consecutive rows are stride pixels apart (stride >= width).
+// For example, in a 100-pixel wide image with img->stride == 128,
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
-//   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//   pixel position (x,y) = (22,1) is stored in img->pixel[150].
+// Images created by ImageCreate have rows aligned to ROW_ALIGN bytes
+// (a cache line, and the widest vector), padded up to the next row:
+// vector kernels never load across a cache line, and row bands processed
+// by different threads never share one.  The padding holds no pixels:
+// it is never read as pixels, and it may be changed by point operations
+// (see pixelRuns).  Mapped images have unpadded rows (stride == width).
+//
+// A view (see ImageView) is an image whose pixels belong to another image,
+// its owner: pixel points inside the owner's array and stride is the
+// owner's stride.  The owner counts its references (itself plus its views)
+// in refs, and its pixels are released when the last reference is destroyed.
+//
+// Data derived from the pixels (the histogram, the result of the last
+// ImageLocateSubImage) is kept in a cache, built when first needed.
+// Every operation that changes pixels increments the version of the
+// pixel owner, and each cached item records the version it was built
+// from, so stale items (including those of views of changed pixels) are
+// never used.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -46,14 +79,47 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// Data derived from the pixels of an image.
+// Each item is valid while its version field is the version of the pixel
+// owner plus one (0: not built yet).
+struct imagecache {
+  unsigned long histVersion;
+  uint64_t hist[256];     // histogram (see ImageStatsEx)
+  unsigned long locateVersion;
+  int lw, lh;             // size of the last subimage searched (ImageLocateSubImage)
+  uint8* lpix;            // its pixels, row by row
+  int found, lx, ly;      // and the result of the search
+};
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
+  int stride;   // distance between consecutive rows, in pixels
   uint8* pixel; // pixel data (a raster scan)
+  void* block;  // allocated block holding pixel (NULL if mapped)
+  size_t blocksize; // size of block, in bytes
+  void* map;    // start of the file mapping holding pixel (NULL if allocated)
+  size_t mapsize; // length of the file mapping
+  Image owner;  // image that owns the pixels (NULL if this image owns them)
+  int refs;     // number of references to the pixels (owners only)
+  unsigned long version;     // number of changes to the pixels (owners only)
+  struct imagecache* cache;  // derived data (NULL until needed)
 };
 
+// Alignment of the rows of images created by ImageCreate, in bytes
+#define ROW_ALIGN 64
+
+// Address of the first pixel in row y
+#define ROW(img, y) ((img)->pixel + (size_t)(y) * (img)->stride)
+
+// Version of the pixels of img (kept by their owner)
+#define VERSION(img) (((img)->owner != NULL ? (img)->owner : (img))->version)
+
+// Record a change to the pixels of img, invalidating derived data
+#define TOUCH(img) (VERSION(img)++)
+
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -143,9 +209,10 @@ static int check(int condition, const char* failmsg) {
 
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, set names of counters and select the vector instruction set
+/// used by pixel kernels.  (Instrumentation is calibrated when first needed.)
 void ImageInit(void) { ///
-  InstrCalibrate();
+  SimdInit();
   InstrName[0] = "pixmem"; // InstrCount[0] will count pixel array acesses
   InstrName[1] = "compare";  
   // Name other counters here...
@@ -153,9 +220,138 @@ void ImageInit(void) { ///
 }
 
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
+// (bulk counts unless INSTR_LEVEL is 0, see instrumentation.h)
+#define PIXMEM InstrCounter(1, 0)
 // Add more macros here...
-#define compare InstrCount[1]
+#define compare InstrCounter(1, 1)
+// Single pixel accesses are counted only if INSTR_LEVEL is 2
+#define PIXMEM_FINE InstrCounter(2, 0)
+
+// Counters are per thread (see instrumentation.h), so band functions
+// running in pool threads may simply add to them.
+
+// Time the calling public function as an instrumentation region named
+// after it, ended when the function returns.
+// Used by the operations that process pixels in bulk (not by the O(1) ones).
+// Declare that w x h pixels were read and written once each by a kernel
+// like kernel (INSTR_LUT, ...), for the efficiency shown by InstrPrint.
+// (Neither does anything if INSTR_LEVEL is 0.)
+#if INSTR_LEVEL >= 1
+#define REGION() \
+  int region_ __attribute__((cleanup(regionEnd), unused)) = (InstrBegin(__func__), 0)
+
+static void regionEnd(int* region) {
+  (void)region;
+  InstrEnd();
+}
+
+#define KERNEL(kernel, w, h) InstrKernel(kernel, 2 * (unsigned long long)(w) * (unsigned long long)(h))
+#else
+#define REGION() ((void)0)
+#define KERNEL(kernel, w, h) ((void)0)
+#endif
+
+// Minimum number of rows per band of a parallel operation (see
+// PoolParallelFor): about 64K pixels, so that small images are processed
+// sequentially.
+static int rowGrain(size_t width) {
+  return (width > 0 && width < 65536) ? (int)(65536 / width) : 1;
+}
+
+// Cache of derived data of img, created if needed.
+// Returns NULL if there is no memory for it (then nothing is cached).
+static struct imagecache* imageCache(Image img) {
+  if (img->cache == NULL) {
+    img->cache = calloc(1, sizeof(struct imagecache));
+  }
+  return img->cache;
+}
+
+// Pool of pixel blocks
+//
+// Pipelines create and destroy many images of the same few sizes (every
+// rotate, mirror, crop and blur creates one).  Instead of returning the
+// pixel blocks to the system, ImageDestroy keeps them in free lists, one
+// per size class, and ImageCreate reuses them: no new pages to fault in
+// and zero, and no zeroing at all for operations that overwrite every
+// pixel (see imageNew).
+// There are 4 size classes per power of two, so blocks are at most 25%
+// larger than needed (the unused tail of a large block is never touched).
+// Each thread has its own free lists, so no locking is needed; a block
+// freed by one thread may be reused by another.  The total size of the
+// blocks kept, in all threads, is limited by poolLimit.
+
+// Smallest block kept (malloc is fast enough for smaller ones)
+#define POOL_MIN 4096
+// Number of size classes
+#define POOL_CLASSES 256
+
+static size_t poolLimit = (size_t)256 << 20;  // 256 MiB
+static size_t poolBytes = 0;                  // total size of the blocks kept
+
+// First free block of each size class (each free block starts with a
+// pointer to the next one)
+static __thread void* poolFree[POOL_CLASSES];
+
+// Size class of a block of at least n bytes: sets *size to the size of
+// the blocks of the class.  Returns -1 for blocks that are not pooled.
+static int poolClass(size_t n, size_t* size) {
+  if (n < POOL_MIN || n > ((size_t)1 << 62) || n > poolLimit) {
+    *size = n;
+    return -1;
+  }
+  int p = 63 - __builtin_clzll(n);
+  size_t step = (size_t)1 << (p - 2);
+  *size = (n + step - 1) & ~(step - 1);
+  p = 63 - __builtin_clzll(*size);
+  return 4 * p + (int)(*size >> (p - 2)) - 4;
+}
+
+// Get a block of (at least) n bytes, zeroed if zero is nonzero.
+// Sets *size to the size of the block.  Returns NULL if out of memory.
+static void* poolGet(size_t n, int zero, size_t* size) {
+  int c = poolClass(n, size);
+  if (c >= 0 && poolFree[c] != NULL) {
+    void* block = poolFree[c];
+    poolFree[c] = *(void**)block;
+    __atomic_fetch_sub(&poolBytes, *size, __ATOMIC_RELAXED);
+    if (zero) memset(block, 0, n);
+    return block;
+  }
+  //calloc (e não malloc + memset): blocos grandes vêm do sistema já a zero,
+  //e as páginas só ocupam memória quando usadas
+  return zero ? calloc(*size, 1) : malloc(*size);
+}
+
+// Release a block of size bytes (as set by poolGet), keeping it if there is room.
+static void poolPut(void* block, size_t size) {
+  size_t csize;
+  int c = poolClass(size, &csize);
+  if (c >= 0 && csize == size &&
+      __atomic_add_fetch(&poolBytes, size, __ATOMIC_RELAXED) <= poolLimit) {
+    *(void**)block = poolFree[c];
+    poolFree[c] = block;
+    return;
+  }
+  if (c >= 0 && csize == size) __atomic_fetch_sub(&poolBytes, size, __ATOMIC_RELAXED);
+  free(block);
+}
+
+/// Limit the total size of the pixel blocks kept for reuse after images
+/// are destroyed (default: 256 MiB).  0 disables reuse.
+/// Blocks kept by the calling thread are released down to the new limit.
+void ImageSetPoolLimit(size_t bytes) { ///
+  poolLimit = bytes;
+  for (int c = POOL_CLASSES - 1; c >= 0; c--) {
+    while (poolFree[c] != NULL && __atomic_load_n(&poolBytes, __ATOMIC_RELAXED) > poolLimit) {
+      void* block = poolFree[c];
+      poolFree[c] = *(void**)block;
+      int p = c / 4;
+      __atomic_fetch_sub(&poolBytes, (size_t)(4 + c % 4) << (p - 2), __ATOMIC_RELAXED);
+      free(block);
+    }
+  }
+}
 
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
@@ -163,19 +359,12 @@ void ImageInit(void) { ///
 
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) { ///
+// Create a new image, as ImageCreate, with black pixels if zero is nonzero,
+// or undefined pixels otherwise (for operations that set every pixel).
+static Image imageNew(int width, int height, uint8 maxval, int zero) {
   assert (width >= 0);
   assert (height >= 0);
   assert (0 < maxval && maxval <= PixMax);
-  // Insert your code here!
 
   Image newImage = malloc(sizeof(struct image));              //Aloca memória para uma nova imagem
   if(newImage == NULL){                                       //Verifica se a alocação de memória para a imagem foi bem-sucedida
@@ -187,37 +376,128 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   newImage->width = width;                                    // Atribui valores aos membros da estrutura da imagem 
   newImage->height = height;                                  // Atribui valores aos membros da estrutura da imagem 
   newImage->maxval = maxval;                                  // Atribui valores aos membros da estrutura da imagem 
-
-  newImage->pixel =calloc(width * height, sizeof(uint8_t));   //Aloca memória para os dados dos pixels
-  if(newImage->pixel == NULL){                                //Verifica se a alocação de memória para os pixels foi bem-sucedida 
+  newImage->stride = 0;                                       // Definido abaixo, com as linhas alinhadas
+  newImage->map = NULL;                                       // Os pixels não pertencem a um mapeamento de ficheiro
+  newImage->mapsize = 0;
+  newImage->owner = NULL;                                     // A imagem é dona dos seus pixels
+  newImage->refs = 1;
+  newImage->version = 0;
+  newImage->cache = NULL;
+
+  //Linhas alinhadas a ROW_ALIGN bytes: stride é a largura arredondada para cima
+  //O número de pixels pode exceder 2^31: calcula-se em size_t, verificando se cabe
+  size_t stride = ((size_t)width + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+  size_t size = stride * (size_t)height;
+  if (stride > INT_MAX || (height > 0 && size / (size_t)height != stride) || size > SIZE_MAX - ROW_ALIGN) {
+    errCause = "Image too large";
+    errno = 12;
+    free(newImage);
+    return NULL;
+  }
+  newImage->stride = (int)stride;
+  //Bloco reutilizado (ou novo) do pool; o início é alinhado à mão
+  newImage->block = poolGet(size + ROW_ALIGN - 1, zero, &newImage->blocksize);   //Aloca memória para os dados dos pixels
+  if(newImage->block == NULL){                                //Verifica se a alocação de memória para os pixels foi bem-sucedida 
     errCause = "Memory alloction failed";                     //Defenição das mensagens de erro
     errno = 12;
     free(newImage);                                           //Liberta a estrutura de imagem previamente alocada
     return NULL;                                              //Retorna NULL para indicar falha
   }  
+  uintptr_t addr = (uintptr_t)newImage->block;
+  newImage->pixel = (uint8*)newImage->block + (-addr & (ROW_ALIGN - 1));
   return newImage;                                            //Retorna a imagem criada
 }
 
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// The number of pixels is only limited by memory (it may exceed 2^32).
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  REGION();
+  // Insert your code here!
+  return imageNew(width, height, maxval, 1);
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
+/// Destroying a view does not affect its owner.  Destroying an image that
+/// still has views keeps its pixels alive until the last view is destroyed.
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) { ///
   assert (imgp != NULL);                                      //Verifica se o ponteiro para a imagem não é nulo
   // Insert your code here!
   if (*imgp != NULL) {                                        //Verifica se  o ponteiro para a estrutura de imagem não é nulo
-    
-    free((*imgp)->pixel);                                     //Liberta a memória dos dados dos pixels
+    Image owner = ((*imgp)->owner != NULL) ? (*imgp)->owner : *imgp;
+    if ((*imgp)->cache != NULL) {                             //Dados derivados
+      free((*imgp)->cache->lpix);
+      free((*imgp)->cache);
+    }
+    if (*imgp != owner) {
+      free(*imgp);                                            //Uma vista só liberta a sua estrutura
+    }
+    if (--owner->refs == 0) {                                 //Última referência aos pixels
+#if defined(__linux__) || defined(__APPLE__)
+      if (owner->map != NULL) {                               //Os pixels estão num mapeamento do ficheiro (ImageMap)
+        errsave = errno;
+        munmap(owner->map, owner->mapsize);                   //Desfaz o mapeamento em vez de libertar
+        errno = errsave;
+      } else
+#endif
+      poolPut(owner->block, owner->blocksize);                //Liberta (ou guarda para reutilizar) a memória dos dados dos pixels
 
-    
-    free(*imgp);                                              //Liberta a memória da estrutura da imagem
+      
+      free(owner);                                            //Liberta a memória da estrutura da imagem
+    }
 
     
     *imgp = NULL;                                             //Define o ponteiro como nulo para indicar que a imagem foi destruída
   }
 }
 
+/// Create a view of a rectangular part of img.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// The view shares the pixels of img: changing one changes the other.
+/// Views may be used wherever an image is expected, and views of views
+/// are allowed.  img and the view may be destroyed in any order.
+/// Operations on two images (paste, blend) must not be given overlapping
+/// views of the same image.
+///
+/// On success, a new view is returned.
+/// (The caller is responsible for destroying the returned view!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  Image view = malloc(sizeof(struct image));
+  if (view == NULL) {
+    errCause = "Memory allocation failed";
+    errno = 12;
+    return NULL;
+  }
+  *view = *img;
+  view->width = w;
+  view->height = h;
+  view->pixel = ROW(img, y) + x;
+  view->owner = (img->owner != NULL) ? img->owner : img;
+  view->owner->refs++;
+  view->refs = 0;
+  view->cache = NULL;
+  return view;
+}
+
 
 /// PGM file operations
 
@@ -236,34 +516,130 @@ static int skipComments(FILE* f) {
   return i;
 }
 
+// Parse the header of a raw PGM file.
+// On success, returns nonzero, sets (*w, *h, *maxval) and leaves f
+// positioned at the first pixel.
+// On failure, returns 0 and errCause is set accordingly.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
+// Read rows [y0, y1) of img from f, in one call if they are contiguous.
+// Returns nonzero on success; on failure returns 0 and sets errCause.
+static int readRows(Image img, int y0, int y1, FILE* f) {
+  int w = img->width;
+  size_t size = (size_t)w * (y1 - y0);
+  PIXMEM += (unsigned long)size;  // count pixel memory accesses
+  if (img->stride == w || y1 - y0 <= 1) {
+    return check( fread(ROW(img, y0), sizeof(uint8), size, f) == size, "Reading pixels" );
+  }
+#if defined(__linux__)
+  //Linhas com padding: lidas diretamente para o seu lugar, muitas por chamada ao sistema
+  //(a partir da posição lógica de f, que avança depois com fseeko)
+  off_t pos = ftello(f);
+  if (pos >= 0) {
+    struct iovec iov[256];
+    int y = y0;
+    while (y < y1) {
+      int n = y1 - y < 256 ? y1 - y : 256;
+      for (int k = 0; k < n; k++) {
+        iov[k].iov_base = ROW(img, y + k);
+        iov[k].iov_len = (size_t)w;
+      }
+      ssize_t r = preadv(fileno(f), iov, n, pos);
+      if (r != (ssize_t)n * w) {
+        //Leitura parcial (ou erro): as linhas inteiras lidas ficam, o resto lê-se com fread
+        int done = r > 0 ? (int)(r / w) : 0;
+        y += done;
+        pos += (off_t)done * w;
+        break;
+      }
+      y += n;
+      pos += (off_t)n * w;
+    }
+    if (fseeko(f, pos, SEEK_SET) == 0) {
+      y0 = y;
+    }
+  }
+#endif
+  int success = 1;
+  for (int y = y0; success && y < y1; y++) {
+    success = check( fread(ROW(img, y), sizeof(uint8), w, f) == (size_t)w, "Reading pixels" );
+  }
+  return success;
+}
+
+// Write rows [y0, y1) of img to f, in one call if they are contiguous.
+// Returns nonzero on success; on failure returns 0 and sets errCause.
+static int writeRows(Image img, int y0, int y1, FILE* f) {
+  int w = img->width;
+  size_t size = (size_t)w * (y1 - y0);
+  PIXMEM += (unsigned long)size;  // count pixel memory accesses
+  if (img->stride == w || y1 - y0 <= 1) {
+    return check( fwrite(ROW(img, y0), sizeof(uint8), size, f) == size, "Writing pixels failed" );
+  }
+  int success = 1;
+  size_t skip = 0;  // bytes of row y0 already written
+#if defined(__linux__)
+  //Linhas com padding: escritas diretamente do seu lugar, muitas por chamada ao sistema
+  //(depois de esvaziar o buffer de f, para manter a ordem)
+  if (fflush(f) == 0) {
+    struct iovec iov[256];
+    while (y0 < y1) {
+      int n = y1 - y0 < 256 ? y1 - y0 : 256;
+      for (int k = 0; k < n; k++) {
+        iov[k].iov_base = ROW(img, y0 + k);
+        iov[k].iov_len = (size_t)w;
+      }
+      ssize_t r = writev(fileno(f), iov, n);
+      if (r != (ssize_t)n * w) {
+        //Escrita parcial (ou erro): o resto escreve-se com fwrite
+        if (r > 0) {
+          y0 += (int)(r / w);
+          skip = (size_t)(r % w);
+        }
+        break;
+      }
+      y0 += n;
+    }
+  }
+#endif
+  for (int y = y0; success && y < y1; y++) {
+    success = check( fwrite(ROW(img, y) + skip, sizeof(uint8), w - skip, f) == w - skip, "Writing pixels failed" );
+    skip = 0;
+  }
+  return success;
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
+  REGION();
   int w, h;
   int maxval;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  readHeader(f, &w, &h, &maxval) &&
   // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  (img = imageNew(w, h, (uint8)maxval, 0)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  readRows(img, 0, h, f);
 
   // Cleanup
   if (!success) {
@@ -275,12 +651,76 @@ Image ImageLoad(const char* filename) { ///
   return img;
 }
 
+/// Map a raw PGM file into memory.
+/// Like ImageLoad, but the pixels are not read: the image uses the file
+/// contents directly, through a private memory mapping, so loading is
+/// almost free and the page cache is shared with other processes.
+///   flags : IMAGE_MAP_PRIVATE or IMAGE_MAP_READONLY.
+/// With IMAGE_MAP_PRIVATE, the image may be modified in-place
+/// (copy-on-write: the file is never changed).
+/// With IMAGE_MAP_READONLY, the image must not be modified in-place.
+/// On systems without mmap, this is the same as ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMap(const char* filename, int flags) { ///
+  REGION();
+#if defined(__linux__) || defined(__APPLE__)
+  int w, h;
+  int maxval;
+  long offset;
+  struct stat st;
+  void* map = MAP_FAILED;
+  FILE* f = NULL;
+  Image img = NULL;
+  int prot = (flags & IMAGE_MAP_READONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PGM header
+  readHeader(f, &w, &h, &maxval) &&
+  check( (offset = ftell(f)) >= 0, "Reading pixels" ) &&
+  // The whole pixel array must be in the file
+  check( fstat(fileno(f), &st) == 0, "Reading pixels" ) &&
+  check( (long long)st.st_size - offset >= (long long)w*h, "Reading pixels" ) &&
+  // Map the file (private: writes never reach the file)
+  check( (map = mmap(NULL, (size_t)st.st_size, prot, MAP_PRIVATE, fileno(f), 0)) != MAP_FAILED, "Mapping failed" ) &&
+  check( (img = malloc(sizeof(struct image))) != NULL, "Memory allocation failed" );
+
+  if (success) {
+    img->width = w;
+    img->height = h;
+    img->maxval = maxval;
+    img->stride = w;
+    img->pixel = (uint8*)map + offset;
+    img->block = NULL;
+    img->blocksize = 0;
+    img->map = map;
+    img->mapsize = (size_t)st.st_size;
+    img->owner = NULL;
+    img->refs = 1;
+    img->version = 0;
+    img->cache = NULL;
+  } else {
+    errsave = errno;
+    if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);  // the mapping stays valid after closing
+  return img;
+#else
+  (void)flags;
+  return ImageLoad(filename);
+#endif
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
+  REGION();
   int w = img->width;
   int h = img->height;
   uint8 maxval = img->maxval;
@@ -289,8 +729,7 @@ int ImageSave(Image img, const char* filename) { ///
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
   check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  writeRows(img, 0, h, f);
 
   // Cleanup
   if (f != NULL) fclose(f);
@@ -320,27 +759,104 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+// Operands of the bands of ImageStatsEx
+struct histband {
+  Image img;
+  uint64_t* hist;  // histogram of the whole image
+};
+
+// Histogram of rows [lo, hi), added to b->hist.
+// Four sub-histograms are used in turn, so that runs of equal pixels do
+// not wait for each other's counter updates.
+static void histogramBand(void* arg, int band, int lo, int hi) {
+  struct histband* b = arg;
+  Image img = b->img;
+  uint64_t sub[4][256] = { { 0 } };
+  for (int y = lo; y < hi; y++) {
+    const uint8* row = ROW(img, y);
+    int x = 0;
+    for (; x + 4 <= img->width; x += 4) {
+      sub[0][row[x]]++;
+      sub[1][row[x + 1]]++;
+      sub[2][row[x + 2]]++;
+      sub[3][row[x + 3]]++;
+    }
+    for (; x < img->width; x++) {
+      sub[0][row[x]]++;
+    }
+  }
+  for (int v = 0; v < 256; v++) {
+    uint64_t n = sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+    if (n > 0) {
+      __atomic_fetch_add(&b->hist[v], n, __ATOMIC_RELAXED);
+    }
+  }
+  PIXMEM += (size_t)(hi - lo) * img->width;
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// For an empty image, both are set to 0.
 void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (img != NULL);
-  // Insert your code here!
-  if (img->width <= 0 || img->height <= 0) {
-    fprintf(stderr, "Invalid image dimensions for stats calculation\n");
-    return;
+  REGION();
+  ImageStatsEx(img, min, max, NULL, NULL, NULL);
+}
+
+/// Histogram
+/// On return, hist[v] is the number of pixels with gray level v,
+/// for v in [0, 255].
+void ImageHistogram(Image img, uint64 hist[256]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  REGION();
+  ImageStatsEx(img, NULL, NULL, NULL, NULL, hist);
+}
+
+/// Extended pixel stats, in a single pass over the pixels.
+/// On return,
+/// *min and *max are set as in ImageStats,
+/// *mean is set to the mean gray level,
+/// *variance is set to the variance of the gray levels (population
+/// variance: mean squared deviation from the mean),
+/// hist is set as in ImageHistogram.
+/// Any of the pointers may be NULL, if that result is not wanted.
+/// For an empty image, all results are 0.
+void ImageStatsEx(Image img, uint8* min, uint8* max, double* mean, double* variance, uint64 hist[256]) { ///
+  assert (img != NULL);
+  REGION();
+  //Histograma numa só passagem (ou da cache); o resto calcula-se a partir dele
+  uint64_t local[256];
+  struct imagecache* c = imageCache(img);
+  uint64_t* h = c != NULL ? c->hist : local;
+  if (c == NULL || c->histVersion != VERSION(img) + 1) {
+    memset(h, 0, 256 * sizeof(uint64_t));
+    struct histband b = { .img = img, .hist = h };
+    PoolParallelFor(img->height, rowGrain(img->width), histogramBand, &b);
+    if (c != NULL) c->histVersion = VERSION(img) + 1;
   }
-  *min = *max = img->pixel[0];
 
-  for (int i = 1; i < img->width * img->height; i++) {
-    if (img->pixel[i] < *min) {
-      *min = img->pixel[i];
-    }
-    if (img->pixel[i] > *max) {
-      *max = img->pixel[i];
+  uint64_t n = 0, s1 = 0, s2 = 0;
+  int lo = 256, hi = -1;
+  for (int v = 0; v < 256; v++) {
+    if (h[v] > 0) {
+      if (lo > v) lo = v;
+      hi = v;
     }
+    n += h[v];
+    s1 += h[v] * v;
+    s2 += h[v] * v * v;
+    if (hist != NULL) hist[v] = h[v];
+  }
+  if (min != NULL) *min = n > 0 ? (uint8)lo : 0;
+  if (max != NULL) *max = n > 0 ? (uint8)hi : 0;
+  if (mean != NULL) *mean = n > 0 ? (double)s1 / (double)n : 0.0;
+  //Variância exata em inteiros: (N*S2 - S1^2) / N^2
+  if (variance != NULL) {
+    *variance = n > 0 ? (double)((__int128)n * s2 - (__int128)s1 * s1) / ((double)n * (double)n) : 0.0;
   }
 }
 
@@ -361,8 +877,8 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
         return 0; 
     }
 
-    //Verifica se o retângulo se estende além dos extremos 
-    if (x + w > img->width || y + h > img->height) {
+    //Verifica se o retângulo se estende além dos extremos (sem calcular x + w, que pode exceder INT_MAX)
+    if (w < 0 || h < 0 || w > img->width - x || h > img->height - y) {
         //Não é válido, o retângulo passa além das extremidades da imagem
         return 0;  
     }
@@ -381,16 +897,16 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
+// The returned index must satisfy (0 <= index < img->stride*img->height)
 //Gera o índice correspondente à posição(x,y) na matriz unidimensional
-static inline int G(Image img, int x, int y) {
-  int index;
+static inline size_t G(Image img, int x, int y) {
+  size_t index;
   // Insert your code here!
 
   assert(0 <= x && x < img->width);                         //Garante que x está dentro dos limites da largura da imagem
   assert(0 <= y && y < img->height);                        //Garante que y está dentro dos limites da altura da imagem
-  index = y * img->width + x;                               //Calcula o índice na matriz unidimensional
-  assert (0 <= index && index < img->width*img->height);    //Garante que o índice calculado está dentro dos limites da matriz
+  index = (size_t)y * img->stride + x;                      //Calcula o índice na matriz unidimensional (em size_t: pode exceder 2^31)
+  assert (index < (size_t)img->stride * img->height);       //Garante que o índice calculado está dentro dos limites da matriz
   return index;
 }
 
@@ -398,7 +914,7 @@ static inline int G(Image img, int x, int y) {
 uint8 ImageGetPixel(Image img, int x, int y) {              //Obtém o pixel na posição(x,y) para um novo nível
   assert (img != NULL);                                     //Verifica se o ponteiro para a imagem não é nulo
   assert (ImageValidPos(img, x, y));                        //Verifica se a posição (x,y) é válida dentro da imagem
-  PIXMEM += 1;                                              //incrementa o contador de acesso ao pixel
+  PIXMEM_FINE += 1;                                         //incrementa o contador de acesso ao pixel
   return img->pixel[G(img, x, y)];                          //Retorna o valor do pixel na posição (x, y)
 } 
 
@@ -406,7 +922,8 @@ uint8 ImageGetPixel(Image img, int x, int y) {              //Obtém o pixel na
 void ImageSetPixel(Image img, int x, int y, uint8 level) {  //Define o pixel na posição (x, y) para um novo nível.
   assert (img != NULL);                                     //Verifica se o ponteiro para a imagem não é nulo
   assert (ImageValidPos(img, x, y));                        //Verifica se a posição (x, y) é válida dentro da imagem
-  PIXMEM += 1;                                              //Incrementa o contador de acesso ao pixel    
+  PIXMEM_FINE += 1;                                         //Incrementa o contador de acesso ao pixel    
+  TOUCH(img);                                               //Invalida os dados derivados
   img->pixel[G(img, x, y)] = level;                         //Define o valor do pixel na posição (x, y) para o novo nível
 } 
 
@@ -418,15 +935,88 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) {  //Define o pixel na
 /// All of these functions modify the image in-place: no allocation involved.
 /// They never fail.
 
+// The operations below run in parallel, in bands of rows, through the
+// thread pool (see threadpool.h).  Every pixel is computed exactly as in a
+// sequential run, so results do not depend on the number of threads.
+// Each band task receives its operands in a struct band.
+struct band {
+  Image img;      // image processed (source for new images)
+  Image img2;     // second image (result, pasted or blended image)
+  Image mask;     // alpha mask (blend)
+  Bitmap bmp;     // packed bilevel image (bitmap conversions)
+  int x, y;       // position of img2 in img (crop, paste, blend)
+  int dx, dy;     // blur displacements
+  uint8 level;    // threshold level
+  int cw;         // rotate clockwise
+  double factor;  // brightening factor or blending alpha
+  const struct simdbrighten* bp;  // exact fixed-point form of factor (or NULL)
+  const uint8* lut;  // lookup table
+  uint8* out;     // result buffer (blur)
+  size_t ostride; // distance between rows of out
+  int y0;         // first row computed into out (blur)
+  int failed;     // set by a band that failed
+};
+
+// Split rows [lo, hi) of img into runs of contiguous pixels, for the
+// kernels in simd.h.  Returns the number of runs and sets *len to their
+// length; run r starts at ROW(img, lo + r).
+// Rows with no gap between them (stride == width) form a single run.
+// So do the padded rows of an image that owns its pixels: the padding
+// goes through the kernel too (it holds no pixels, and no view can see
+// it), so there are no short rows and scalar tails.  The rows of a view
+// are separated by pixels of its owner, so each is a run.
+static int pixelRuns(Image img, int lo, int hi, size_t* len) {
+  if (img->stride == img->width || img->owner == NULL) {
+    *len = (size_t)(hi - lo - 1) * img->stride + img->width;
+    return 1;
+  }
+  *len = (size_t)img->width;
+  return hi - lo;
+}
+
+/// Set the number of threads used by image operations.
+/// n == 0 selects the number of online processors.
+/// Results are identical whatever the number of threads.
+void ImageSetThreads(int n) { ///
+  assert (n >= 0);
+  PoolSetThreads(n);
+}
+
+/// Get the number of threads used by image operations.
+int ImageThreads(void) { ///
+  return PoolThreads();
+}
+
+static void negativeBand(void* arg, int band, int lo, int hi) {
+  Image img = ((struct band*)arg)->img;
+  size_t len;
+  int runs = pixelRuns(img, lo, hi, &len);
+  //Calcula o negativo dos pixels das linhas [lo, hi) (kernel vetorial)
+  for (int r = 0; r < runs; r++) {
+    SimdNegative(ROW(img, lo + r), len, img->maxval);
+  }
+}
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) {                                   //Inverte os valores dos pixels na imagem
   assert (img != NULL);                                           //Verifica se o ponteiro para a imagem não é nulo
-  // Insert your code here!
-  for(int i=0; i<img->width * img->height;i++){                   //Itera sobre todos os pixels na imagem
-    img->pixel[i]=img->maxval -img->pixel[i];                     //Calcula o negativo de cada pixel em relação ao valor máximo
+  REGION();
+  TOUCH(img);
+  struct band b = { .img = img };
+  PoolParallelFor(img->height, rowGrain(img->width), negativeBand, &b);
+  KERNEL(INSTR_LUT, img->width, img->height);
+}
+
+static void thresholdBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img = b->img;
+  size_t len;
+  int runs = pixelRuns(img, lo, hi, &len);
+  //Pixels abaixo do limiar passam a preto e os restantes a branco (kernel vetorial)
+  for (int r = 0; r < runs; r++) {
+    SimdThreshold(ROW(img, lo + r), len, b->level, img->maxval);
   }
 }
 
@@ -435,12 +1025,25 @@ void ImageNegative(Image img) {                                   //Inverte os v
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) {                       
   assert (img != NULL);                                          //Verifica se o ponteiro para a imagem não é nulo
-  // Insert your code here!
-   for (int i = 0; i < img->width * img->height; i++) {          //Itera sobre todos os pixels na imagem
-    if (img->pixel[i] < thr) {                                   //Verifica se o valor do pixel é inferior ao limiar
-      img->pixel[i] = 0;                                         //Define para preto
+  REGION();
+  TOUCH(img);
+  struct band b = { .img = img, .level = thr };
+  PoolParallelFor(img->height, rowGrain(img->width), thresholdBand, &b);
+  KERNEL(INSTR_LUT, img->width, img->height);
+}
+
+static void brightenBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img = b->img;
+  size_t len;
+  int runs = pixelRuns(img, lo, hi, &len);
+  for (int r = 0; r < runs; r++) {
+    if (b->bp != NULL) {
+      //Forma em vírgula fixa exata para todos os níveis: usa o kernel vetorial
+      SimdBrighten(ROW(img, lo + r), len, b->bp);
     } else {
-      img->pixel[i] = img->maxval;                               //Define para branco
+      //Caso contrário, usa a tabela com o resultado exato de cada nível
+      SimdApplyLUT(ROW(img, lo + r), len, b->lut);
     }
   }
 }
@@ -452,28 +1055,138 @@ void ImageThreshold(Image img, uint8 thr) {
 void ImageBrighten(Image img, double factor) {                        //Aumenta o brilho da imagem multiplicando cada pixel por um fator
   assert (img != NULL);                                               //Verifica se o ponteiro para a imagem não é nulo
   assert (factor >= 0.0);                                             //Verifica se o fator de aumento de brilho é não negativo
-  // Insert your code here!
-  
+  REGION();
+  TOUCH(img);
+  struct simdbrighten bp;
+  uint8 lut[256];
+  struct band b = { .img = img, .factor = factor, .lut = lut };
+  if (SimdBrightenPrepare(factor, img->maxval, &bp)) {
+    b.bp = &bp;
+  } else {
+    ImageLUTBrighten(lut, factor, img->maxval);
+  }
+  PoolParallelFor(img->height, rowGrain(img->width), brightenBand, &b);
+  KERNEL(INSTR_LUT, img->width, img->height);
+}
 
-  
+/// Lookup tables
 
-  for (int i = 0; i < img->width * img->height; i++) {                //Itera através de cada pixel na imagem
+/// Any transformation of pixel levels (such as the three above, or any
+/// sequence of them) is a function of the level alone, and may be stored
+/// as a table lut, where lut[v] is the new level of pixels with level v.
 
-    double intensity = img->pixel[i]; 
+static void lutBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img = b->img;
+  size_t len;
+  int runs = pixelRuns(img, lo, hi, &len);
+  //Substitui cada pixel das linhas [lo, hi) pelo valor correspondente na tabela
+  for (int r = 0; r < runs; r++) {
+    SimdApplyLUT(ROW(img, lo + r), len, b->lut);
+  }
+}
 
-    
+/// Apply a lookup table to image: each pixel with level v gets level lut[v].
+/// The image is changed in-place, in a single pass.
+void ImageApplyLUT(Image img, const uint8 lut[256]) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+  REGION();
+  TOUCH(img);
+  struct band b = { .img = img, .lut = lut };
+  PoolParallelFor(img->height, rowGrain(img->width), lutBand, &b);
+  KERNEL(INSTR_LUT, img->width, img->height);
+}
+
+/// Fill lut with the identity transformation.
+void ImageLUTIdentity(uint8 lut[256]) { ///
+  for (int v = 0; v < 256; v++) {
+    lut[v] = (uint8)v;
+  }
+}
+
+/// Fill lut with the transformation done by ImageNegative
+/// on an image with the given maxval.
+void ImageLUTNegative(uint8 lut[256], uint8 maxval) { ///
+  for (int v = 0; v < 256; v++) {
+    lut[v] = (uint8)(maxval - v);
+  }
+}
+
+/// Fill lut with the transformation done by ImageThreshold(img, thr)
+/// on an image with the given maxval.
+void ImageLUTThreshold(uint8 lut[256], uint8 thr, uint8 maxval) { ///
+  for (int v = 0; v < 256; v++) {
+    lut[v] = v < thr ? 0 : maxval;
+  }
+}
+
+/// Fill lut with the transformation done by ImageBrighten(img, factor)
+/// on an image with the given maxval.
+/// Requires: factor >= 0.0.
+void ImageLUTBrighten(uint8 lut[256], double factor, uint8 maxval) { ///
+  assert (factor >= 0.0);
+  for (int v = 0; v < 256; v++) {
+    double intensity = v;
     intensity *= factor;                                              //Multiplica a intensidade pelo fator
+    lut[v] = intensity > maxval ? maxval : (uint8)(intensity + 0.5); //Satura em maxval ou arredonda
+  }
+}
 
-    
-    if (intensity > img->maxval) {                                    //Satura em maxval
-        img->pixel[i]=img->maxval;                                    //intensidade = img->maxval;
-    }
-    else{
-      img->pixel[i] = (uint8) (intensity+0.5);                        //Atualiza o valor do pixel para a intensidade calculada, arredondando para o inteiro mais próximo
-    }
+/// Compose two lookup tables: lut becomes the transformation that applies
+/// first and then second.  lut may be the same array as first or second.
+void ImageLUTCompose(uint8 lut[256], const uint8 first[256], const uint8 second[256]) { ///
+  uint8 tmp[256];
+  for (int v = 0; v < 256; v++) {
+    tmp[v] = second[first[v]];
+  }
+  memcpy(lut, tmp, sizeof(tmp));
+}
+
+
+/// Bitmaps
+
+static void toBitmapBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  PIXMEM += (size_t)(hi - lo) * b->img->width;
+  for (int y = lo; y < hi; y++) {
+    BitmapPackRow(b->bmp, y, ROW(b->img, y), b->level);   //8 pixels por byte (kernel vetorial)
+  }
+}
+
+/// Convert image to a bitmap, as ImageThreshold would.
+Bitmap ImageToBitmap(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  REGION();
+  Bitmap bmp = BitmapCreate(img->width, img->height);
+  if (bmp == NULL) {
+    errCause = BitmapErrMsg();
+    return NULL;
+  }
+  struct band b = { .img = img, .bmp = bmp, .level = thr };
+  PoolParallelFor(img->height, rowGrain(img->width), toBitmapBand, &b);
+  return bmp;
+}
+
+static void fromBitmapBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  PIXMEM += (size_t)(hi - lo) * b->img->width;
+  for (int y = lo; y < hi; y++) {
+    BitmapUnpackRow(b->bmp, y, ROW(b->img, y), 0, b->img->maxval);   //Preto: 0, branco: maxval
   }
 }
 
+/// Convert bitmap to a new image with the given maxval.
+Image ImageFromBitmap(Bitmap bmp, uint8 maxval) { ///
+  assert (bmp != NULL);
+  REGION();
+  Image img = imageNew(BitmapWidth(bmp), BitmapHeight(bmp), maxval, 0);
+  if (img == NULL) return NULL;
+  struct band b = { .img = img, .bmp = bmp };
+  PoolParallelFor(img->height, rowGrain(img->width), fromBitmapBand, &b);
+  return img;
+}
+
 
 /// Geometric transformations
 
@@ -488,6 +1201,55 @@ void ImageBrighten(Image img, double factor) {                        //Aumenta
 // Implementation hint: 
 // Call ImageCreate whenever you need a new image!
 
+// Side of the square tiles used by rotations (a 64x64 source tile and the
+// destination rows it maps to stay in L1 cache while it is transposed).
+#define TILE 64
+
+static void rotateBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img = b->img;
+  Image rotatedImg = b->img2;
+  int w = img->width;
+  int h = img->height;
+  ptrdiff_t ws = img->stride;
+  ptrdiff_t rw = rotatedImg->stride;
+  // Itera sobre os blocos TILE x TILE das faixas de blocos [lo, hi)
+  for (int ty = lo; ty < hi; ty++) {
+    int y = ty * TILE;
+    int th = (h - y < TILE) ? h - y : TILE;
+    for (int x = 0; x < w; x += TILE) {
+      int tw = (w - x < TILE) ? w - x : TILE;
+      const uint8* src = ROW(img, y) + x;
+      if (!b->cw) {
+        // Anti-horário: a coluna x+k vai para a linha (w-1-x-k), coluna y
+        uint8* dst = ROW(rotatedImg, w - 1 - x) + y;
+        SimdTranspose(src, ws, dst, -rw, tw, th);
+      } else {
+        // Horário: a coluna x+k vai para a linha x+k, a partir da coluna
+        // (h-1-y), com as linhas da origem lidas de baixo para cima
+        uint8* dst = ROW(rotatedImg, x) + (h - y - th);
+        SimdTranspose(src + (th - 1) * ws, -ws, dst, rw, tw, th);
+      }
+    }
+  }
+}
+
+// Rotate 90 degrees: anti-clockwise if cw == 0, clockwise otherwise
+static Image rotate90(Image img, int cw) {
+  assert (img != NULL);
+  //Cria uma nova imagem com largura e altura trocadas
+  Image rotatedImg = imageNew(img->height, img->width, img->maxval, 0);
+  if (rotatedImg == NULL) {
+    return NULL;
+  }
+  // Processa faixas de blocos em paralelo
+  struct band b = { .img = img, .img2 = rotatedImg, .cw = cw };
+  int tiles = (img->height + TILE - 1) / TILE;
+  PoolParallelFor(tiles, rowGrain(((size_t)img->width + TILE - 1) / TILE * TILE * TILE), rotateBand, &b);
+  KERNEL(INSTR_TRANSPOSE, img->width, img->height);
+  return rotatedImg;
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -496,24 +1258,85 @@ void ImageBrighten(Image img, double factor) {                        //Aumenta
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-
-
 Image ImageRotate(Image img) {                                        //Rotaciona a imagem 90 graus no sentido anti-horário
+  REGION();
   //Verifica se o ponteiro para a imagem não é nulo                                        
   assert (img != NULL);
-  // Insert your code here!
-  //Cria uma nova imagem com largura e altura trocadas
-  Image rotatedImg = ImageCreate(img->height, img->width, img->maxval);
+  return rotate90(img, 0);
+}
+
+/// Rotate an image clockwise.
+/// Returns a version of the image rotated 90 degrees clockwise.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateClockwise(Image img) { ///
+  assert (img != NULL);
+  REGION();
+  return rotate90(img, 1);
+}
+
+// Swap row a with row b reversed (if a == b, reverse the row in place)
+static void swapReversed(uint8* a, uint8* b, int w) {
+  if (a == b) {
+    for (int j = 0, k = w - 1; j < k; j++, k--) {
+      uint8 t = a[j]; a[j] = a[k]; a[k] = t;
+    }
+    return;
+  }
+  int j = 0;
+  // 8 pixels de cada vez, invertendo a ordem dos bytes
+  for (; j + 8 <= w; j += 8) {
+    uint64_t p, q;
+    memcpy(&p, a + j, 8);
+    memcpy(&q, b + w - 8 - j, 8);
+    p = __builtin_bswap64(p);
+    q = __builtin_bswap64(q);
+    memcpy(a + j, &q, 8);
+    memcpy(b + w - 8 - j, &p, 8);
+  }
+  for (; j < w; j++) {
+    uint8 t = a[j]; a[j] = b[w - 1 - j]; b[w - 1 - j] = t;
+  }
+}
+
+static void rotate180Band(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img = b->img;
+  int w = img->width;
+  // A linha i troca com a linha (height-1-i), invertida
+  for (int i = lo; i < hi; i++) {
+    swapReversed(ROW(img, i), ROW(img, img->height - 1 - i), w);
+  }
+}
+
+/// Rotate an image 180 degrees, in place.
+/// Pixel (x, y) moves to (width-1-x, height-1-y).
+/// This needs no extra memory and cannot fail.
+void ImageRotate180(Image img) { ///
+  assert (img != NULL);
+  REGION();
+  TOUCH(img);
+  struct band b = { .img = img };
+  PoolParallelFor((img->height + 1) / 2, rowGrain(2 * (size_t)img->width), rotate180Band, &b);
+  KERNEL(INSTR_MEMCPY, img->width, img->height);
+}
 
-  // Itera sobre cada pixel na imagem original
-  for (int i = 0; i < img->height; i++) {
+static void mirrorBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img = b->img;
+  Image mirroredImg = b->img2;
+  //Itera sobre cada linha [lo, hi) da imagem original
+  for (int i = lo; i < hi; i++) {
+      const uint8* src = ROW(img, i);
+      uint8* dst = ROW(mirroredImg, i);
+      //Copia cada pixel da linha para a posição espelhada horizontalmente
       for (int j = 0; j < img->width; j++) {
-          // Rotaciona os pixels 90 graus no sentido anti-horário e copia para a nova imagem
-          rotatedImg->pixel[(rotatedImg->height - 1 - j) * rotatedImg->width + i] = img->pixel[i * img->width + j];
+          dst[img->width - 1 - j] = src[j];
       }
   }
-  // Retorna a nova imagem rotacionada
-  return rotatedImg;
 }
 
 /// Mirror an image = flip left-right.
@@ -525,20 +1348,25 @@ Image ImageRotate(Image img) {                                        //Rotacion
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) {                                                                          //Espelha a imagem horizontalmente
   assert (img != NULL);                                                                                 //Verifica se o ponteiro para a imagem não é nulo
-  // Insert your code here!
-  Image mirroredImg = ImageCreate(img->width, img->height, img->maxval);                                //Cria uma nova imagem espelhada com a mesma largura e altura 
-
-  //Itera sobre cada linha da imagem original
-  for (int i = 0; i < img->height; i++) {
-      //Itera sobre cada pixel na linha, espelhando horizontalmente
-      for (int j = 0; j < img->width; j++) {
-          //Copia o pixel da imagem original para a imagem espelhada
-          mirroredImg->pixel[i * img->width + (img->width - 1 - j)] = img->pixel[i * img-> width + j];
-      }
+  REGION();
+  Image mirroredImg = imageNew(img->width, img->height, img->maxval, 0);                                //Cria uma nova imagem espelhada com a mesma largura e altura 
+  if (mirroredImg == NULL) {
+    return NULL;
   }
-
+  struct band b = { .img = img, .img2 = mirroredImg };
+  PoolParallelFor(img->height, rowGrain(img->width), mirrorBand, &b);
+  KERNEL(INSTR_MEMCPY, img->width, img->height);
   return mirroredImg;                                                                                   //Retorna a nova imagem espelhada horizontalmente
+}
 
+static void cropBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img = b->img;
+  Image croppedImg = b->img2;
+  //Copia as linhas [lo, hi) da região de corte para a imagem cortada
+  for (int i = lo; i < hi; i++) {
+      memcpy(ROW(croppedImg, i), ROW(img, b->y + i) + b->x, (size_t)croppedImg->width);
+  }
 }
 
 /// Crop a rectangular subimage from img.
@@ -556,25 +1384,30 @@ Image ImageMirror(Image img) {
 Image ImageCrop(Image img, int x, int y, int w, int h) {                                    //Corta uma região específica da imagem
   assert (img != NULL);                                                                     //Verifica se o ponteiro para a imagem não é nulo
   assert (ImageValidRect(img, x, y, w, h));                                                 //Verifica se a região de corte é válida dentro da imagem
-  // Insert your code here!
-  Image croppedImg = ImageCreate(w, h, img->maxval);                                        //Cria uma nova imagem cortada com a largura e altura especificadas
-
-  //Itera sobre cada linha da região de corte
-  for (int i = 0; i < h; i++) {
-      //Itera sobre cada pixel na linha da região de corte
-      for (int j = 0; j < w; j++) {
-          //Copia o pixel da imagem original para a imagem cortada 
-          croppedImg->pixel[i * w + j] = img->pixel[(y + i) * img->width + (x + j)];
-      }
+  REGION();
+  Image croppedImg = imageNew(w, h, img->maxval, 0);                                        //Cria uma nova imagem cortada com a largura e altura especificadas
+  if (croppedImg == NULL) {
+    return NULL;
   }
-
+  struct band b = { .img = img, .img2 = croppedImg, .x = x, .y = y };
+  PoolParallelFor(h, rowGrain(w), cropBand, &b);
+  KERNEL(INSTR_MEMCPY, w, h);
   return croppedImg;                                                                        //Retorna a nova imagem cortada
-
 }
 
 
 /// Operations on two images
 
+static void pasteBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img1 = b->img;
+  Image img2 = b->img2;
+  //Copia as linhas [lo, hi) da imagem a ser colada (img2) para a imagem de destino (img1)
+  for (int i = lo; i < hi; i++) {
+      memcpy(ROW(img1, b->y + i) + b->x, ROW(img2, i), (size_t)img2->width);
+  }
+}
+
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
@@ -583,16 +1416,23 @@ void ImagePaste(Image img1, int x, int y, Image img2) {
   assert (img1 != NULL);                                                                  //Verifica se os ponteiros para as imagens não são nulos
   assert (img2 != NULL);                                                                  
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));                         //Verifica se a região de colagem é válida dentro da imagem de destino (img1)
-  // Insert your code here!
-  //Itera sobre cada linha da imagem a ser colada (img2)
-  for (int i = 0; i < img2->height; i++) {
-      //Itera sobre cada pixel na linha da imagem a ser colada (img2)
-      for (int j = 0; j < img2->width; j++) {
-          //Copia o pixel da imagem a ser colada (img2) para a imagem de destino (img1)
-          img1->pixel[(y + i) * img1->width + (x + j)] = img2->pixel[i * img2->width + j];
-      }
-  }
+  REGION();
+  TOUCH(img1);
+  struct band b = { .img = img1, .img2 = img2, .x = x, .y = y };
+  PoolParallelFor(img2->height, rowGrain(img2->width), pasteBand, &b);
+  KERNEL(INSTR_MEMCPY, img2->width, img2->height);
+}
 
+static void blendBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img1 = b->img;
+  Image img2 = b->img2;
+  //Mistura cada linha [lo, hi) de img2 na linha correspondente de img1
+  for (int i = lo; i < hi; i++) {
+    SimdBlend(ROW(img1, b->y + i) + b->x, ROW(img2, i), (size_t)img2->width, b->factor, (uint8)img1->maxval);
+  }
+  //Dois pixels lidos e um escrito por cada pixel de img2
+  PIXMEM += 3 * (size_t)(hi - lo) * img2->width;
 }
 
 /// Blend an image into a larger image.
@@ -602,152 +1442,1206 @@ void ImagePaste(Image img1, int x, int y, Image img2) {
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {                       //Realiza uma mistura (blend) entre duas imagens em uma posição específica
+  REGION();
   //Verifica se os ponteiros para as imagens não são nulos
   assert (img1 != NULL);
   assert (img2 != NULL);
   //Verifica se a região de mistura é válida dentro da imagem de destino (img1)
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Insert your code here!
-  //Itera sobre cada linha da imagem a ser misturada (img2)
+  TOUCH(img1);
+  struct band b = { .img = img1, .img2 = img2, .x = x, .y = y, .factor = alpha };
+  PoolParallelFor(img2->height, rowGrain(img2->width), blendBand, &b);
+}
+
+static void blendMaskBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  Image img1 = b->img;
+  Image img2 = b->img2;
+  Image mask = b->mask;
+  for (int i = lo; i < hi; i++) {
+    SimdBlendMask(ROW(img1, b->y + i) + b->x, ROW(img2, i), ROW(mask, i), (size_t)img2->width,
+                  (uint8)mask->maxval, (uint8)img1->maxval);
+  }
+  //Três pixels lidos e um escrito por cada pixel de img2
+  PIXMEM += 4 * (size_t)(hi - lo) * img2->width;
+}
+
+/// Blend an image into a larger image, with a per-pixel alpha mask.
+/// Blend img2 into position (x, y) of img1, using alpha = m/maxval(mask)
+/// for each pixel, where m is the corresponding pixel of mask:
+/// each pixel p of img1 under pixel q of img2 becomes
+/// alpha*q + (1-alpha)*p, rounded to the nearest integer (computed
+/// exactly, in integers) and limited to maxval(img1).
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y), and mask must
+/// have the same size as img2.
+void ImageBlendMask(Image img1, int x, int y, Image img2, Image mask) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (mask != NULL);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert (mask->width == img2->width && mask->height == img2->height);
+  REGION();
+  TOUCH(img1);
+  struct band b = { .img = img1, .img2 = img2, .mask = mask, .x = x, .y = y };
+  PoolParallelFor(img2->height, rowGrain(img2->width), blendMaskBand, &b);
+}
+
+// Compare img2 with the subimage of img1 at (x, y), which must fit.
+// Adds the number of pixel comparisons to *cmp.
+static int matchAt(Image img1, int x, int y, Image img2, unsigned long* cmp) {
   for (int i = 0; i < img2->height; i++) {
-      //Itera sobre cada pixel na linha da imagem a ser misturada (img2)
-      for (int j = 0; j < img2->width; j++) {
-        //Calcula o pixel misturado usando a fórmula de mistura com o fator alpha
-        uint8 blended_Pixel = (uint8)(alpha * ImageGetPixel (img2,j,i) + (1.0 -alpha)* ImageGetPixel(img1,x+j,y+i)+0.5);
-          //Garante que o valor do pixel misturado esteja dentro dos limites válidos
-          if(blended_Pixel<0)
-            ImageSetPixel(img1,x+j,y+i,0);
-          else if (blended_Pixel > img1->maxval)
-            ImageSetPixel(img1,x+j,y+i,img1->maxval);
-          else
-            ImageSetPixel(img1,x+j,y+i,blended_Pixel);
+    const uint8* row1 = ROW(img1, y + i) + x;
+    const uint8* row2 = ROW(img2, i);
+    for (int j = 0; j < img2->width; j++) {
+      if (row1[j] != row2[j]) {
+        *cmp += (unsigned long)i * img2->width + j + 1;
+        return 0;
       }
+    }
   }
+  *cmp += (unsigned long)img2->height * img2->width;
+  return 1;
 }
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
-/// Returns 0, otherwise.
+/// Returns 0, otherwise (including when img2 does not fit inside img1
+/// at (x, y)).
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) {                  //// Verifica se uma subimagem é correspondente em uma posição específica dentro de outra imagem
+  REGION();
   //Verifica se os ponteiros para as imagens não são nulos
   assert (img1 != NULL);
   assert (img2 != NULL);
   //Verifica se a posição de início é válida dentro da imagem de destino (img1)
   assert (ImageValidPos(img1, x, y)); 
   // Insert your code here!
-  //Itera sobre cada pixel da subimagem (img2)
-  for (int i = 0; i < img2->height; i++) {
-      //Itera sobre cada pixel na linha da subimagem (img2)
-      for (int j = 0; j < img2->width; j++) {
-          //Conta o número de comparações
-          compare++;
-          //Verifica se a posição é válida dentro da imagem de destino (img1) e se os pixels são diferentes
-          if (ImageValidPos(img1, x + j, y + i) &&
-              img1->pixel[(y + i) * img1->width + (x + j)] != img2->pixel[i * img2->width + j]) {
-              return 0; //Retorna 0 se um pixel diferente for encontrado
-          }
+  //A subimagem tem de caber inteiramente na imagem de destino
+  if (x + img2->width > img1->width || y + img2->height > img1->height) {
+    return 0;
+  }
+  //Compara os pixels e conta o número de comparações
+  unsigned long cmp = 0;
+  int match = matchAt(img1, x, y, img2, &cmp);
+  compare += cmp;
+  return match;
+}
+
+// Subimage search uses a 2D Rabin-Karp rolling hash, modulo 2^64.
+// The hash of the w x h window at (x, y) is
+//   sum over i < h, j < w of  p(x+j, y+i) * HASH_X^(w-1-j) * HASH_Y^(h-1-i).
+// Column hashes (over h rows) roll down one row at a time, and the window
+// hash rolls along each row over the column hashes, so each candidate
+// position costs O(1).  Positions whose hash equals the hash of img2 are
+// confirmed by exact comparison, so collisions cost time but never give
+// wrong results.
+#define HASH_X 0x9E3779B97F4A7C15ull  // multipliers: odd, so that their
+#define HASH_Y 0xC2B2AE3D27D4EB4Full  // powers never vanish modulo 2^64
+
+// Power of an odd multiplier, modulo 2^64
+static uint64_t hashPow(uint64_t base, int e) {
+  uint64_t r = 1;
+  for (; e > 0; e >>= 1, base *= base) {
+    if (e & 1) r *= base;
+  }
+  return r;
+}
+
+// Find the placements of img2 in img1 with top row in [y0, y1), in raster
+// order, storing up to max of them in (xs, ys).
+// Requires: img2 fits inside img1, 0 <= y0 <= y1 <= img1->height-img2->height+1.
+// Adds the number of comparisons to *cmp: one per candidate position plus
+// the pixel comparisons of the exact checks (as ImageMatchSubImage counts).
+// If stop is not NULL, gives up (returning the placements found so far)
+// as soon as *stop < band: some earlier band already has enough of them.
+// Returns the number of placements found (at most max), or -1 if memory
+// could not be allocated.
+static int locateRows(Image img1, Image img2, int y0, int y1, int* xs, int* ys, int max, unsigned long* cmp,
+                      const int* stop, int band) {
+  int W = img1->width;
+  int w = img2->width;
+  int h = img2->height;
+  int n = W - w + 1;  // posições válidas em cada linha
+  uint64_t powX = hashPow(HASH_X, w);
+  uint64_t powY = hashPow(HASH_Y, h);
+
+  //col[x]: hash da coluna x nas linhas [y, y+h) da imagem de destino
+  uint64_t* col = calloc(W > 0 ? W : 1, sizeof(uint64_t));
+  if (col == NULL) return -1;
+
+  //Hash da subimagem (img2), calculado da mesma forma
+  uint64_t target = 0;
+  for (int j = 0; j < w; j++) {
+    uint64_t c = 0;
+    for (int i = 0; i < h; i++) {
+      c = c * HASH_Y + ROW(img2, i)[j];
+    }
+    target = target * HASH_X + c;
+  }
+
+  //Colunas iniciais: linhas [y0, y0+h-1)
+  for (int i = y0; i < y0 + h - 1; i++) {
+    const uint8* row = ROW(img1, i);
+    for (int x = 0; x < W; x++) {
+      col[x] = col[x] * HASH_Y + row[x];
+    }
+  }
+
+  int found = 0;
+  for (int y = y0; y < y1 && found < max; y++) {
+    if (stop != NULL && __atomic_load_n(stop, __ATOMIC_RELAXED) < band) break;
+    //Desliza as colunas: entra a linha y+h-1 e sai a linha y-1
+    const uint8* in = ROW(img1, y + h - 1);
+    if (y > y0) {
+      const uint8* out = ROW(img1, y - 1);
+      for (int x = 0; x < W; x++) {
+        col[x] = col[x] * HASH_Y - out[x] * powY + in[x];
+      }
+    } else {
+      for (int x = 0; x < W; x++) {
+        col[x] = col[x] * HASH_Y + in[x];
+      }
+    }
+    //Hash da janela ao longo da linha
+    uint64_t hsh = 0;
+    for (int j = 0; j < w; j++) {
+      hsh = hsh * HASH_X + col[j];
+    }
+    for (int x = 0; x < n; x++) {
+      if (x > 0) {
+        hsh = hsh * HASH_X - col[x - 1] * powX + col[x + w - 1];
+      }
+      //Só compara os pixels quando os hashes coincidem
+      if (hsh == target && matchAt(img1, x, y, img2, cmp)) {
+        xs[found] = x;
+        ys[found] = y;
+        if (++found == max) break;
       }
+    }
+    *cmp += (unsigned long)n;
   }
-  //Retorna 1 se todos os pixels coincidirem
-  return 1; 
+  free(col);
+  return found;
 }
 
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// The first match in raster order (top to bottom, left to right) is
+/// returned.  Only positions where img2 fits inside img1 are considered.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {         //Localiza a posição de uma subimagem dentro de outra imagem
+  REGION();
   //Verifica se os ponteiros para as imagens não são nulos
   assert (img1 != NULL);
   assert (img2 != NULL);
   // Insert your code here!
-  //Itera sobre cada posição possível na imagem de destino (img1)
-  for (int i = 0; i < img1->height; i++) {
-      for (int j = 0; j < img1->width; j++) {
-          //Conta o número de comparações
-          compare++;
-          //Verifica se a subimagem (img2) coincide com a posição atual na imagem de destino (img1)
-          if (ImageMatchSubImage(img1, j, i, img2)) {
-              //Se coincidir, atualiza as coordenadas e retorna 1
-              *px = j;
-              *py = i;
-              return 1; 
+  //Só as posições onde a subimagem cabe são candidatas
+  int m = img1->height - img2->height + 1;
+  int n = img1->width - img2->width + 1;
+  if (m <= 0 || n <= 0) {
+    return 0;
+  }
+  unsigned long cmp = 0;
+  int x, y;
+  int found = -1;
+  int w = img2->width;
+  int h = img2->height;
+  //Pesquisa repetida da mesma subimagem em img1 inalterada: resultado da cache
+  //(só para subimagens até 1/4 de img1, que são guardadas na cache)
+  int memo = w > 0 && h > 0 && (size_t)w * h <= (size_t)img1->width * img1->height / 4;
+  struct imagecache* c = memo ? imageCache(img1) : NULL;
+  if (c != NULL && c->locateVersion == VERSION(img1) + 1 && c->lw == w && c->lh == h) {
+    int same = 1;
+    for (int i = 0; i < h && same; i++) {
+      same = memcmp(c->lpix + (size_t)i * w, ROW(img2, i), (size_t)w) == 0;
+    }
+    compare += (unsigned long)w * h;
+    if (same) {
+      if (c->found) {
+        *px = c->lx;
+        *py = c->ly;
+      }
+      return c->found;
+    }
+  }
+  if (w > 0 && h > 0) {
+    found = locateRows(img1, img2, 0, m, &x, &y, 1, &cmp, NULL, 0);
+  }
+  if (found < 0) {
+    //Subimagem vazia ou sem memória para os hashes: compara diretamente cada posição
+    found = 0;
+    for (y = 0; y < m; y++) {
+      for (x = 0; x < n; x++) {
+        cmp++;
+        if ((found = matchAt(img1, x, y, img2, &cmp))) break;
+      }
+      if (found) break;
+    }
+  }
+  compare += cmp;
+  if (found) {
+    //Se coincidir, atualiza as coordenadas e retorna 1
+    *px = x;
+    *py = y;
+  }
+  //Guarda a subimagem e o resultado na cache
+  if (c != NULL) {
+    uint8* pix = realloc(c->lpix, (size_t)w * h);
+    c->locateVersion = 0;
+    if (pix != NULL) {
+      c->lpix = pix;
+      for (int i = 0; i < h; i++) {
+        memcpy(pix + (size_t)i * w, ROW(img2, i), (size_t)w);
+      }
+      c->lw = w;
+      c->lh = h;
+      c->found = found;
+      c->lx = found ? x : 0;
+      c->ly = found ? y : 0;
+      c->locateVersion = VERSION(img1) + 1;
+    }
+  }
+  return found;
+}
+
+
+// Operands and results of the bands of ImageLocateAll
+struct locateband {
+  Image img1, img2;
+  int max;
+  int stop;                      // lowest band that found max placements
+  int* xs[POOL_MAX_THREADS];     // placements found by each band
+  int* ys[POOL_MAX_THREADS];
+  int found[POOL_MAX_THREADS];   // how many (-1 on allocation failure)
+};
+
+static void locateBand(void* arg, int band, int lo, int hi) {
+  struct locateband* lb = arg;
+  //Cada faixa guarda no máximo max posições (nunca mais do que as candidatas)
+  int n = lb->img1->width - lb->img2->width + 1;
+  long long cap = (long long)(hi - lo) * n;
+  int max = cap < lb->max ? (int)cap : lb->max;
+  unsigned long cmp = 0;
+  lb->xs[band] = malloc((max > 0 ? max : 1) * sizeof(int));
+  lb->ys[band] = malloc((max > 0 ? max : 1) * sizeof(int));
+  if (lb->xs[band] == NULL || lb->ys[band] == NULL) {
+    lb->found[band] = -1;
+    return;
+  }
+  int found = locateRows(lb->img1, lb->img2, lo, hi, lb->xs[band], lb->ys[band], max, &cmp, &lb->stop, band);
+  lb->found[band] = found;
+  //Com max posições, as faixas seguintes já não contribuem para o resultado
+  if (found == lb->max) {
+    int stop = __atomic_load_n(&lb->stop, __ATOMIC_RELAXED);
+    while (band < stop && !__atomic_compare_exchange_n(&lb->stop, &stop, band, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  }
+  compare += cmp;
+}
+
+/// Locate all occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, and stores the positions of the first
+/// max matches, in raster order (top to bottom, left to right), in
+/// (xs[0], ys[0]), (xs[1], ys[1]), ...
+/// Only positions where img2 fits inside img1 are considered.
+/// The search is split in bands of rows that run in parallel, and stops
+/// early once max matches are known; the result does not depend on the
+/// number of threads.
+/// Requires: max >= 0, and xs and ys have room for max positions.
+/// On success, returns the number of matches stored (at most max).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateAll(Image img1, Image img2, int* xs, int* ys, int max) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (max >= 0);
+  REGION();
+  int m = img1->height - img2->height + 1;
+  int n = img1->width - img2->width + 1;
+  if (m <= 0 || n <= 0 || max == 0) {
+    return 0;
+  }
+  if (img2->width == 0 || img2->height == 0) {
+    //Subimagem vazia: coincide em todas as posições
+    int found = 0;
+    for (int y = 0; y < m && found < max; y++) {
+      for (int x = 0; x < n && found < max; x++) {
+        xs[found] = x;
+        ys[found] = y;
+        found++;
+      }
+    }
+    return found;
+  }
+
+  struct locateband lb = { .img1 = img1, .img2 = img2, .max = max, .stop = POOL_MAX_THREADS };
+  //Cada faixa recalcula as somas das h-1 linhas acima dela: faixas de pelo menos h linhas
+  int grain = rowGrain(img1->width);
+  if (grain < img2->height) grain = img2->height;
+  int bands = PoolParallelFor(m, grain, locateBand, &lb);
+
+  //Junta os resultados pela ordem das faixas (e portanto por ordem de varrimento)
+  int found = 0;
+  int failed = 0;
+  for (int b = 0; b < bands; b++) {
+    if (lb.found[b] < 0) failed = 1;
+    for (int i = 0; !failed && i < lb.found[b] && found < max; i++) {
+      xs[found] = lb.xs[b][i];
+      ys[found] = lb.ys[b][i];
+      found++;
+    }
+    //Uma faixa interrompida só pode estar depois de uma faixa com max posições
+    if (found == max) break;
+  }
+  for (int b = 0; b < bands; b++) {
+    free(lb.xs[b]);
+    free(lb.ys[b]);
+  }
+  if (failed) {
+    errCause = "Memory allocation failed";
+    errno = 12;
+    return -1;
+  }
+  return found;
+}
+
+
+/// Template matching
+
+// ImageMatchNCC scores each placement (x, y) of img2 (the template T,
+// with N = w*h pixels) in img1 (I, the window under the template) with
+//   score = (N*S(IT) - S(I)*S(T)) / sqrt((N*S(I^2) - S(I)^2) * (N*S(T^2) - S(T)^2))
+// where S sums over the template area.  S(I) and S(I^2) come from column
+// sums sliding down the rows (as in the blur); S(IT), the correlation,
+// is computed directly for small templates and with FFTs otherwise.
+// The correlation is an integer, and FFT results are rounded to it, so
+// numerators and variances are exact and both methods give the same scores.
+//
+// FFT method (overlap-save): img1 is split into tiles of px x py pixels,
+// each giving (px-w+1) x (py-h+1) placements.  The correlation of a tile
+// with T is the inverse FFT of FFT(tile) * conj(FFT(T)).  As T is real,
+// two tiles go in one complex FFT, one as the real part and one as the
+// imaginary part, and their correlations come out in the same parts.
+
+// Best placement found so far
+struct nccbest {
+  double key;     // numerator*|numerator|/variance: orders placements by score
+  __int128 num;   // N*S(IT) - S(I)*S(T)
+  __int128 var;   // N*S(I^2) - S(I)^2
+  int x, y;
+};
+
+// Operands of the bands of ImageMatchNCC
+struct nccband {
+  Image img1, img2;
+  int nx, ny;            // number of placements in each direction
+  uint64_t st;           // S(T)
+  int px, py;            // FFT tile size (0 for the direct method)
+  int fs;                // distance between rows of the FFT arrays
+  int tilesX, tilesY;    // tiles in each direction
+  FFTPlan plan;
+  const double* tre;     // FFT of the template
+  const double* tim;
+  struct nccbest best[POOL_MAX_THREADS];  // best placement of each band
+  int failed;            // set by a band that failed
+};
+
+// Window sums for a row of placements [x0, x0+nu) x {y}, for consecutive y
+struct nccwin {
+  int x0, nu;
+  int y;           // row of the sums (-1 before the first row)
+  uint64_t* s1;    // s1[c]: sum of column x0+c over rows [y, y+h)
+  uint64_t* s2;    // s2[c]: sum of squares
+};
+
+// Is placement (key, x, y) better than *b?  Ties go to raster order.
+static int nccBetter(double key, int x, int y, const struct nccbest* b) {
+  return key > b->key || (key == b->key && (y < b->y || (y == b->y && x < b->x)));
+}
+
+// Score the placements [x0, x0+nu) x {y}, whose correlations are
+// corr[u]*scale, and keep the best in *best.
+// y must follow the row of the previous call with the same win, if any.
+static void nccScoreRow(const struct nccband* nb, struct nccwin* win, int y, const double* corr, double scale,
+                        struct nccbest* best) {
+  Image img1 = nb->img1;
+  int w = nb->img2->width;
+  int h = nb->img2->height;
+  int cols = win->nu + w - 1;
+  unsigned long acc = 0;
+  //Somas de coluna: janela vertical [y, y+h)
+  if (win->y < 0) {
+    for (int c = 0; c < cols; c++) {
+      win->s1[c] = win->s2[c] = 0;
+    }
+    for (int i = 0; i < h; i++) {
+      const uint8* row = ROW(img1, y + i) + win->x0;
+      for (int c = 0; c < cols; c++) {
+        win->s1[c] += row[c];
+        win->s2[c] += (uint32_t)row[c] * row[c];
+      }
+    }
+    acc += (unsigned long)h * cols;
+  } else {
+    const uint8* in = ROW(img1, y + h - 1) + win->x0;
+    const uint8* out = ROW(img1, y - 1) + win->x0;
+    for (int c = 0; c < cols; c++) {
+      win->s1[c] += in[c];
+      win->s1[c] -= out[c];
+      win->s2[c] += (uint32_t)in[c] * in[c];
+      win->s2[c] -= (uint32_t)out[c] * out[c];
+    }
+    acc += 2 * (unsigned long)cols;
+  }
+  win->y = y;
+
+  //Somas horizontais deslizantes sobre as somas de coluna
+  __int128 n = (__int128)w * h;
+  double nd = (double)w * h;
+  double std = (double)(int64_t)nb->st;
+  double bound = best->key * (1.0 - 0x1p-40);
+  int64_t s1 = 0, s2 = 0;
+  for (int c = 0; c < w - 1; c++) {
+    s1 += win->s1[c];
+    s2 += win->s2[c];
+  }
+  for (int u = 0; u < win->nu; u++) {
+    s1 += win->s1[u + w - 1];
+    s2 += win->s2[u + w - 1];
+    //Arredonda ao inteiro mais próximo (|corr| < 2^51)
+    double corr1 = (corr[u] * scale + 0x1.8p52) - 0x1.8p52;
+    //Majorante da chave em vírgula flutuante (com margem para os erros de
+    //arredondamento): só as posições que podem igualar ou superar a melhor
+    //são calculadas exatamente.  Sem saltos: o sinal do numerador pode
+    //variar de uma posição para a seguinte (imagens com ruído)
+    double a = nd * corr1, b = (double)s1 * std;
+    double c = nd * (double)s2, d = (double)s1 * (double)s1;
+    double numHi = a - b + 0x1p-50 * (fabs(a) + b);
+    double varLo = c - d - 0x1p-50 * (c + d);
+    int pos = numHi > 0.0;
+    int skip = (varLo > 0.0) & ((pos & (numHi * numHi < bound * varLo)) | (!pos & (bound > 0.0)));
+    if (!skip) {
+      __int128 num = n * (int64_t)corr1 - (__int128)s1 * nb->st;
+      __int128 var = n * s2 - (__int128)s1 * s1;
+      //Janelas sem variação têm pontuação 0
+      double key = var > 0 ? (double)num * fabs((double)num) / (double)var : 0.0;
+      if (nccBetter(key, win->x0 + u, y, best)) {
+        best->key = key;
+        best->num = var > 0 ? num : 0;
+        best->var = var;
+        best->x = win->x0 + u;
+        best->y = y;
+        bound = key * (1.0 - 0x1p-40);
+      }
+    }
+    s1 -= win->s1[u];
+    s2 -= win->s2[u];
+  }
+  PIXMEM += acc;
+}
+
+// Direct method: placements in rows [lo, hi)
+static void nccDirectBand(void* arg, int band, int lo, int hi) {
+  struct nccband* nb = arg;
+  Image img1 = nb->img1;
+  Image img2 = nb->img2;
+  int w = img2->width;
+  struct nccbest* best = &nb->best[band];
+  struct nccwin win = { .x0 = 0, .nu = nb->nx, .y = -1 };
+  uint64_t* sum = malloc(nb->nx * sizeof(uint64_t));
+  double* corr = malloc(nb->nx * sizeof(double));
+  win.s1 = malloc((nb->nx + w) * sizeof(uint64_t));
+  win.s2 = malloc((nb->nx + w) * sizeof(uint64_t));
+  if (sum == NULL || corr == NULL || win.s1 == NULL || win.s2 == NULL) {
+    nb->failed = 1;
+  } else {
+    for (int y = lo; y < hi; y++) {
+      //Correlação S(IT) de cada posição da linha y
+      for (int u = 0; u < nb->nx; u++) {
+        sum[u] = 0;
+      }
+      for (int i = 0; i < img2->height; i++) {
+        const uint8* row1 = ROW(img1, y + i);
+        const uint8* row2 = ROW(img2, i);
+        for (int u = 0; u < nb->nx; u++) {
+          uint64_t s = 0;
+          for (int j = 0; j < w; j++) {
+            s += (uint32_t)row1[u + j] * row2[j];
           }
+          sum[u] += s;
+        }
       }
+      for (int u = 0; u < nb->nx; u++) {
+        corr[u] = (double)sum[u];
+      }
+      PIXMEM += 2 * (size_t)nb->nx * w * img2->height;
+      nccScoreRow(nb, &win, y, corr, 1.0, best);
+    }
   }
-  //Retorna 0 se a subimagem não for encontrada em nenhuma posição
-  return 0; 
+  free(sum);
+  free(corr);
+  free(win.s1);
+  free(win.s2);
+}
+
+// Copy row y of tile t of img1 into a row of an FFT array (zero-padded).
+// Returns 0 if the row is below img1 (and so all zero), nonzero otherwise.
+static int nccLoadRow(const struct nccband* nb, int t, int y, double* dst) {
+  Image img1 = nb->img1;
+  int x0 = (t % nb->tilesX) * (nb->px - nb->img2->width + 1);
+  int y0 = (t / nb->tilesX) * (nb->py - nb->img2->height + 1);
+  int cols = img1->width - x0 < nb->px ? img1->width - x0 : nb->px;
+  int c = 0;
+  if (y0 + y < img1->height) {
+    const uint8* src = ROW(img1, y0 + y) + x0;
+    for (; c < cols; c++) {
+      dst[c] = src[c];
+    }
+    PIXMEM += (size_t)cols;
+  }
+  for (int k = c; k < nb->fs; k++) {
+    dst[k] = 0.0;
+  }
+  return c > 0;
+}
+
+// Prepare win for the placements of tile t.
+// Returns the number of rows of placements, and sets *y0 to the first.
+static int nccTileWin(const struct nccband* nb, int t, struct nccwin* win, int* y0) {
+  int sx = nb->px - nb->img2->width + 1;
+  int sy = nb->py - nb->img2->height + 1;
+  win->x0 = (t % nb->tilesX) * sx;
+  win->nu = nb->nx - win->x0 < sx ? nb->nx - win->x0 : sx;
+  win->y = -1;
+  *y0 = (t / nb->tilesX) * sy;
+  return nb->ny - *y0 < sy ? nb->ny - *y0 : sy;
+}
+
+// FFT method: pairs of tiles [lo, hi)
+// Each row is transformed right after it is loaded, and each row of
+// correlations is scored right after its inverse transform, while it is
+// still in cache.
+static void nccFFTBand(void* arg, int band, int lo, int hi) {
+  struct nccband* nb = arg;
+  struct nccbest* best = &nb->best[band];
+  size_t size = (size_t)nb->fs * nb->py;
+  int tiles = nb->tilesX * nb->tilesY;
+  double scale = 1.0 / ((double)nb->px * nb->py);
+  double* re = malloc(size * sizeof(double));
+  double* im = malloc(size * sizeof(double));
+  struct nccwin win[2];
+  for (int i = 0; i < 2; i++) {
+    win[i].s1 = malloc(nb->px * sizeof(uint64_t));
+    win[i].s2 = malloc(nb->px * sizeof(uint64_t));
+  }
+  if (re == NULL || im == NULL || win[0].s1 == NULL || win[0].s2 == NULL ||
+      win[1].s1 == NULL || win[1].s2 == NULL) {
+    nb->failed = 1;
+  } else {
+    for (int p = lo; p < hi; p++) {
+      //Duas faixas numa só FFT complexa: uma na parte real, outra na imaginária
+      int pair = 2 * p + 1 < tiles;
+      for (int y = 0; y < nb->py; y++) {
+        double* r = re + (size_t)y * nb->fs;
+        double* i = im + (size_t)y * nb->fs;
+        int loaded = nccLoadRow(nb, 2 * p, y, r);
+        if (pair) {
+          loaded |= nccLoadRow(nb, 2 * p + 1, y, i);
+        } else {
+          for (int k = 0; k < nb->fs; k++) i[k] = 0.0;
+        }
+        //Linhas nulas continuam nulas
+        if (loaded) FFTRow(nb->plan, r, i, -1);
+      }
+      FFTColumns(nb->plan, re, im, -1);
+      //Multiplica pelo conjugado do espectro do modelo
+      for (size_t k = 0; k < size; k++) {
+        double a = re[k], b = im[k];
+        re[k] = a * nb->tre[k] + b * nb->tim[k];
+        im[k] = b * nb->tre[k] - a * nb->tim[k];
+      }
+      FFTColumns(nb->plan, re, im, 1);
+      int y0[2];
+      int nv[2];
+      nv[0] = nccTileWin(nb, 2 * p, &win[0], &y0[0]);
+      nv[1] = pair ? nccTileWin(nb, 2 * p + 1, &win[1], &y0[1]) : 0;
+      for (int v = 0; v < nv[0] || v < nv[1]; v++) {
+        double* r = re + (size_t)v * nb->fs;
+        double* i = im + (size_t)v * nb->fs;
+        FFTRow(nb->plan, r, i, 1);
+        if (v < nv[0]) nccScoreRow(nb, &win[0], y0[0] + v, r, scale, best);
+        if (v < nv[1]) nccScoreRow(nb, &win[1], y0[1] + v, i, scale, best);
+      }
+    }
+  }
+  free(re);
+  free(im);
+  for (int i = 0; i < 2; i++) {
+    free(win[i].s1);
+    free(win[i].s2);
+  }
+}
+
+// Largest FFT tile considered (in pixels), unless the template needs more
+#define NCC_MAX_TILE (1 << 22)
+
+// Choose the FFT tile size for ImageMatchNCC, minimizing the estimated
+// cost, and compare it with the cost of the direct method (per
+// placement, N multiply-adds).
+// Sets (*px, *py) to the tile size, or to 0 if the direct method is cheaper.
+static void nccPlan(int W, int H, int w, int h, int* px, int* py) {
+  int nx = W - w + 1;
+  int ny = H - h + 1;
+  double best = (double)nx * ny * w * h;  // direct method
+  *px = *py = 0;
+  for (int tx = FFTSize(w); tx <= FFTSize(W); tx *= 2) {
+    for (int ty = FFTSize(h); ty <= FFTSize(H); ty *= 2) {
+      if ((double)tx * ty > NCC_MAX_TILE && (tx > FFTSize(w) || ty > FFTSize(h))) continue;
+      double tiles = ceil((double)nx / (tx - w + 1)) * ceil((double)ny / (ty - h + 1));
+      //Duas FFTs (direta e inversa) por par de faixas, ~8 operações por ponto e nível
+      double cost = ceil(tiles / 2) * 2 * 8.0 * tx * ty * log2((double)tx * ty) + 16.0 * nx * ny;
+      if (cost < best) {
+        best = cost;
+        *px = tx;
+        *py = ty;
+      }
+    }
+  }
+}
+
+/// Find the best match of a template by normalized cross-correlation.
+/// Searches for img2 inside img1, scoring each position (x, y) where img2
+/// fits with the normalized cross-correlation (Pearson correlation) of
+/// img2 and the subimage of img1 at (x, y), in [-1, 1], so that matches
+/// are found despite noise and changes in brightness and contrast.
+/// Positions where either image has no variation score 0.
+/// Small templates are compared directly; larger ones use FFTs,
+/// in O(N log N) time.
+/// On success, returns 1 and sets (*px, *py) to the position with the
+/// highest score (the first in raster order, if tied) and *pscore to it.
+/// If img2 is empty or does not fit inside img1, returns 0 and leaves
+/// (*px, *py, *pscore) untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageMatchNCC(Image img1, Image img2, int* px, int* py, double* pscore) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  REGION();
+  int w = img2->width;
+  int h = img2->height;
+  struct nccband nb = { .img1 = img1, .img2 = img2, .nx = img1->width - w + 1, .ny = img1->height - h + 1 };
+  if (w == 0 || h == 0 || nb.nx <= 0 || nb.ny <= 0) {
+    return 0;
+  }
+
+  //Estatísticas do modelo (img2)
+  uint64_t st2 = 0;
+  for (int i = 0; i < h; i++) {
+    for (int j = 0; j < w; j++) {
+      uint8 v = ROW(img2, i)[j];
+      nb.st += v;
+      st2 += (uint32_t)v * v;
+    }
+  }
+  PIXMEM += (unsigned long)w * h;
+  __int128 n = (__int128)w * h;
+  __int128 tvar = n * st2 - (__int128)nb.st * nb.st;
+
+  for (int b = 0; b < POOL_MAX_THREADS; b++) {
+    nb.best[b].key = -INFINITY;
+  }
+  double* tre = NULL;
+  double* tim = NULL;
+  int bands;
+  nccPlan(img1->width, img1->height, w, h, &nb.px, &nb.py);
+  if (nb.px == 0) {
+    bands = PoolParallelFor(nb.ny, 1 + rowGrain(nb.nx) / ((size_t)w * h), nccDirectBand, &nb);
+  } else {
+    //Espectro do modelo, calculado uma vez
+    nb.tilesX = (nb.nx + nb.px - w) / (nb.px - w + 1);
+    nb.tilesY = (nb.ny + nb.py - h) / (nb.py - h + 1);
+    nb.plan = FFTCreate(nb.px, nb.py);
+    nb.fs = nb.plan != NULL ? FFTStride(nb.plan) : nb.px;
+    size_t size = (size_t)nb.fs * nb.py;
+    tre = calloc(size, sizeof(double));
+    tim = calloc(size, sizeof(double));
+    if (nb.plan == NULL || tre == NULL || tim == NULL) {
+      nb.failed = 1;
+      bands = 0;
+    } else {
+      for (int i = 0; i < h; i++) {
+        for (int j = 0; j < w; j++) {
+          tre[(size_t)i * nb.fs + j] = ROW(img2, i)[j];
+        }
+      }
+      FFT2D(nb.plan, tre, tim, -1, h);
+      nb.tre = tre;
+      nb.tim = tim;
+      int pairs = (nb.tilesX * nb.tilesY + 1) / 2;
+      bands = PoolParallelFor(pairs, 1, nccFFTBand, &nb);
+    }
+    FFTDestroy(&nb.plan);
+    free(tre);
+    free(tim);
+  }
+  if (nb.failed) {
+    errCause = "Memory allocation failed";
+    errno = 12;
+    return -1;
+  }
+
+  //Melhor posição de todas as faixas
+  struct nccbest* best = &nb.best[0];
+  for (int b = 1; b < bands; b++) {
+    if (nccBetter(nb.best[b].key, nb.best[b].x, nb.best[b].y, best)) {
+      best = &nb.best[b];
+    }
+  }
+  double score = 0.0;
+  if (best->var > 0 && tvar > 0) {
+    score = (double)best->num / sqrt((double)best->var * (double)tvar);
+    if (score > 1.0) score = 1.0;
+    if (score < -1.0) score = -1.0;
+  }
+  *px = best->x;
+  *py = best->y;
+  *pscore = score;
+  return 1;
 }
 
 
 /// Filtering
 
+// Compute rows [y0, y1) of the (2dx+1)x(2dy+1) mean filter of img.
+// Windows are clipped to the bounds of img.
+// Row y0 of the result is stored at out[0], row y0+1 at out[ostride], etc.
+// The cost per pixel does not depend on dx or dy: a column-sum array
+// slides down the rows and a running sum slides along each row.
+// Returns 0 on allocation failure (errno/errCause set), nonzero otherwise.
+static int blurRows(Image img, int dx, int dy, int y0, int y1, uint8* out, size_t ostride) {
+  int w = img->width;
+  int h = img->height;
+  unsigned long acc = 0;  // pixel memory accesses
+
+  //Somas de coluna: colSum[x] é a soma dos pixels da coluna x nas linhas [y-dy, y+dy] que estão dentro da imagem.
+  uint32_t* colSum = calloc(w > 0 ? w : 1, sizeof(uint32_t));
+  if (colSum == NULL) {
+    errCause = "Memory allocation failed";
+    errno = 12;
+    return 0;
+  }
+
+  //Inicializa as somas de coluna com as linhas [y0-dy-1, y0+dy-1] (a primeira sai logo na linha y0)
+  for (int l = (y0 - dy - 1 > 0 ? y0 - dy - 1 : 0); l < y0 + dy && l < h; l++) {
+    const uint8* row = ROW(img, l);
+    for (int x = 0; x < w; x++) {
+      colSum[x] += row[x];
+    }
+    acc += (unsigned long)w;
+  }
+
+  for (int y = y0; y < y1; y++) {
+    //Desliza a janela vertical: entra a linha y+dy e sai a linha y-dy-1
+    if (y + dy < h) {
+      const uint8* row = ROW(img, y + dy);
+      for (int x = 0; x < w; x++) {
+        colSum[x] += row[x];
+      }
+      acc += (unsigned long)w;
+    }
+    if (y - dy - 1 >= 0) {
+      const uint8* row = ROW(img, y - dy - 1);
+      for (int x = 0; x < w; x++) {
+        colSum[x] -= row[x];
+      }
+      acc += (unsigned long)w;
+    }
+    //Número de linhas da janela (recortada pelos limites da imagem)
+    uint64_t rows = (uint64_t)((y + dy < h ? y + dy : h - 1) - (y - dy > 0 ? y - dy : 0) + 1);
+
+    //Soma horizontal deslizante sobre as somas de coluna, inicializada com as colunas [0, dx-1]
+    uint64_t sum = 0;
+    for (int k = 0; k < dx && k < w; k++) {
+      sum += colSum[k];
+    }
+    uint8* dst = out + (size_t)(y - y0) * ostride;
+    for (int x = 0; x < w; x++) {
+      if (x + dx < w) {
+        sum += colSum[x + dx];
+      }
+      if (x - dx - 1 >= 0) {
+        sum -= colSum[x - dx - 1];
+      }
+      uint64_t count = rows * (uint64_t)((x + dx < w ? x + dx : w - 1) - (x - dx > 0 ? x - dx : 0) + 1);
+
+      //Média arredondada ao inteiro mais próximo (metades para cima), igual a round(sum / count)
+      uint64_t mean = (2 * sum + count) / (2 * count);
+      //Garante que o valor médio esteja dentro dos limites válidos
+      dst[x] = (uint8)(mean > (uint64_t)img->maxval ? img->maxval : mean);
+    }
+    acc += (unsigned long)w;
+  }
+  free(colSum);
+  PIXMEM += acc;
+  return 1;
+}
+
+static void blurBand(void* arg, int band, int lo, int hi) {
+  struct band* b = arg;
+  uint8* out = b->out + (size_t)lo * b->ostride;
+  if (!blurRows(b->img, b->dx, b->dy, b->y0 + lo, b->y0 + hi, out, b->ostride)) {
+    b->failed = 1;
+  }
+}
+
+// Compute rows [y0, y1) of the mean filter of img into out, like blurRows,
+// splitting the rows into bands processed in parallel.
+// Each band rebuilds its own column sums from the rows around it (its
+// halo), so the result is the same for any number of bands.
+// Returns 0 on allocation failure (errno/errCause set), nonzero otherwise.
+static int blurParallel(Image img, int dx, int dy, int y0, int y1, uint8* out, size_t ostride) {
+  struct band b = { .img = img, .dx = dx, .dy = dy, .out = out, .ostride = ostride, .y0 = y0 };
+  //Cada faixa tem pelo menos 2dy+1 linhas, para limitar o trabalho repetido nos halos
+  int grain = rowGrain(img->width);
+  if (grain < 2 * dy + 1) grain = 2 * dy + 1;
+  PoolParallelFor(y1 - y0, grain, blurBand, &b);
+  if (b.failed) {
+    errCause = "Memory allocation failed";
+    errno = 12;
+    return 0;
+  }
+  return 1;
+}
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
 void ImageBlur(Image img, int dx, int dy) {                             //Aplica um efeito de desfoque (blur) em uma imagem
-  // Insert your code here!
   assert(img != NULL);                                                  //Verifica se o ponteiro para a imagem não é nulo e se os parâmetros de desfoque são válidos
   assert(dx >= 0 && dy >= 0);
+  REGION();
+  TOUCH(img);
 
   //Cria uma nova imagem para armazenar o resultado do desfoque
-  Image newImage = ImageCreate(img->width, img->height, img->maxval);
+  Image newImage = imageNew(img->width, img->height, img->maxval, 0);
 
   //Verifica se a criação da nova imagem foi bem-sucedida
   if (newImage == NULL) {
     return;
   }
+  if (!blurParallel(img, dx, dy, 0, img->height, newImage->pixel, newImage->stride)) {
+    ImageDestroy(&newImage);
+    return;
+  }
+  if (img->owner != NULL || img->refs > 1) {
+    //Vistas (ou imagens com vistas) partilham os pixels: copia o resultado linha a linha
+    for (int y = 0; y < img->height; y++) {
+      memcpy(ROW(img, y), ROW(newImage, y), (size_t)img->width);
+    }
+  } else {
+    //Troca os buffers de pixels em vez de copiar o resultado para a imagem original
+    //(o bloco alocado, ou o mapeamento de ficheiro, acompanha o buffer original)
+    uint8* tmp = img->pixel;
+    img->pixel = newImage->pixel;
+    newImage->pixel = tmp;
+    void* block = img->block;
+    img->block = newImage->block;
+    newImage->block = block;
+    size_t blocksize = img->blocksize;
+    img->blocksize = newImage->blocksize;
+    newImage->blocksize = blocksize;
+    int stride = img->stride;
+    img->stride = newImage->stride;
+    newImage->stride = stride;
+    newImage->map = img->map;
+    newImage->mapsize = img->mapsize;
+    img->map = NULL;
+    img->mapsize = 0;
+  }
+  //Liberta a imagem temporária (que agora contém os pixels originais)
+  ImageDestroy(&newImage);
+}
 
-  //Itera sobre cada pixel na imagem original
-  for (size_t i = 0; i < img->width; i++) {
-    for (size_t j = 0; j < img->height; j++) {
-      
-      double sum = 0;
-      double count = 0;
-      int startX = i - dx;
-      int startY = j - dy;
-
-      //Garante que as coordenadas de início não sejam negativas
-      if (startX < 0) {
-        startX = 0;
-      }
-      if (startY < 0) {
-        startY = 0;
-      }
 
-      //Itera sobre uma região definida pelos parâmetros de desfoque
-      for (size_t k = startX; k <= i + dx; k++) {
-        for (size_t l = startY; l <= j + dy; l++) {
-          //Verifica se a posição é válida na imagem original
-          if (ImageValidPos(img, k, l)) {
-            //Soma os valores dos pixels na região para calcular a média
-            sum += ImageGetPixel(img, k, l);
-            count++;
-          }
-        }
-      }
+/// Strip streaming
 
-      //Calcula a média e arredonda para o valor mais próximo
-      uint8 mean = (uint8)round(sum / count);
-      //Garante que o valor médio esteja dentro dos limites válidos
-      if (mean > img->maxval) {
-        mean = img->maxval;
-      } else if (mean < 0) {
-        mean = 0;
-      }
+// Images too large for memory may be processed as a sequence of strips:
+// images with the full width and a few rows each, read from and written
+// to PGM files sequentially by an ImageStream.
+// Point operations (ImageNegative, ImageThreshold, ImageBrighten) apply
+// to strips directly.  Blurring needs rows above and below each strip,
+// so it goes through a BlurStream that keeps a halo of dy rows.
 
-      // Define o pixel na nova imagem com o valor médio calculado
-      ImageSetPixel(newImage, i, j, mean);
-    }
+// Internal structure for a PGM file read or written in strips
+struct imagestream {
+  FILE* f;
+  int writing;  // nonzero if created for writing
+  int width;
+  int height;
+  int maxval;
+  int row;      // number of rows read or written so far
+};
+
+// Internal structure for blurring an image that arrives in strips
+struct blurstream {
+  int width;
+  int height;
+  int dx, dy;
+  Image win;    // input rows [top, received) still needed
+  int top;      // image row stored in the first row of win
+  int received; // number of input rows pushed so far
+  int emitted;  // number of output rows returned so far
+};
+
+/// Open a raw PGM file for reading in strips.
+/// Only 8 bit PGM files are accepted.
+/// On success, a new stream is returned, positioned at row 0.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpen(const char* filename) { ///
+  REGION();
+  int w, h;
+  int maxval;
+  FILE* f = NULL;
+  ImageStream s = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(f, &w, &h, &maxval) &&
+  check( (s = malloc(sizeof(struct imagestream))) != NULL, "Memory allocation failed" );
+
+  if (!success) {
+    errsave = errno;
+    if (f != NULL) fclose(f);
+    errno = errsave;
+    return NULL;
   }
-  // Copia os pixels da nova imagem para a imagem original
-  for (size_t i = 0; i < img->width; i++) {
-    for (size_t j = 0; j < img->height; j++) {
-      ImageSetPixel(img, i, j, ImageGetPixel(newImage, i, j));
-    }
+  s->f = f;
+  s->writing = 0;
+  s->width = w;
+  s->height = h;
+  s->maxval = maxval;
+  s->row = 0;
+  return s;
+}
+
+/// Create a raw PGM file to be written in strips.
+///   width, height : the dimensions of the whole image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// Exactly height rows must be written before closing the stream.
+/// On success, a new stream is returned.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamCreate(const char* filename, int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  REGION();
+  FILE* f = NULL;
+  ImageStream s = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P5\n%d %d\n%u\n", width, height, maxval) > 0, "Writing header failed" ) &&
+  check( (s = malloc(sizeof(struct imagestream))) != NULL, "Memory allocation failed" );
+
+  if (!success) {
+    errsave = errno;
+    if (f != NULL) fclose(f);
+    errno = errsave;
+    return NULL;
   }
-  //Libera a memória alocada para a nova imagem
-  ImageDestroy(&newImage);
+  s->f = f;
+  s->writing = 1;
+  s->width = width;
+  s->height = height;
+  s->maxval = maxval;
+  s->row = 0;
+  return s;
+}
+
+/// Close a stream (and the file).
+///   sp : address of an ImageStream variable.
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+/// Returns nonzero on success.
+/// For a stream being written, fails (returns 0 and sets errno/errCause)
+/// if not all rows were written or the file could not be completed.
+int ImageStreamClose(ImageStream* sp) { ///
+  assert (sp != NULL);
+  REGION();
+  ImageStream s = *sp;
+  if (s == NULL) return 1;
+  int success = 1;
+  if (s->writing) {
+    success =
+    check( s->row == s->height, "Missing rows" ) &&
+    check( fflush(s->f) == 0, "Writing pixels failed" );
+  }
+  errsave = errno;
+  fclose(s->f);
+  free(s);
+  errno = errsave;
+  *sp = NULL;
+  return success;
+}
+
+/// Get the width of the streamed image
+int ImageStreamWidth(ImageStream s) { ///
+  assert (s != NULL);
+  return s->width;
+}
+
+/// Get the height of the streamed image
+int ImageStreamHeight(ImageStream s) { ///
+  assert (s != NULL);
+  return s->height;
+}
+
+/// Get the maximum gray level of the streamed image
+int ImageStreamMaxval(ImageStream s) { ///
+  assert (s != NULL);
+  return s->maxval;
+}
+
+/// Read the next strip of (at most) nrows rows.
+/// Requires: s was opened for reading, nrows > 0.
+/// Returns a new image with the full width and the rows read, which has
+/// fewer than nrows rows near the end, and 0 rows after the last one.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageStreamRead(ImageStream s, int nrows) { ///
+  assert (s != NULL && !s->writing);
+  assert (nrows > 0);
+  REGION();
+  int n = s->height - s->row;
+  if (n > nrows) n = nrows;
+  Image strip = NULL;
+
+  int success =
+  (strip = imageNew(s->width, n, s->maxval, 0)) != NULL &&
+  readRows(strip, 0, n, s->f);
+
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&strip);
+    errno = errsave;
+    return NULL;
+  }
+  s->row += n;
+  return strip;
+}
+
+/// Append the rows of strip to the file.
+/// Requires: s was created for writing, strip has the width of s and
+/// no more rows than are still missing.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately.
+int ImageStreamWrite(ImageStream s, Image strip) { ///
+  assert (s != NULL && s->writing);
+  assert (strip != NULL);
+  assert (strip->width == s->width);
+  assert (strip->height <= s->height - s->row);
+  REGION();
+
+  int success = writeRows(strip, 0, strip->height, s->f);
+
+  if (success) s->row += strip->height;
+  return success;
+}
+
+/// Create the state to blur an image that arrives in strips.
+///   width, height : the dimensions of the whole image.
+///   dx, dy : filter displacements, as in ImageBlur.
+/// Requires: width, height, dx and dy must be non-negative.
+/// Memory use is bounded by one strip plus 2*dy rows.
+/// On success, a new blur stream is returned.
+/// (The caller is responsible for destroying the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BlurStream ImageBlurStreamCreate(int width, int height, int dx, int dy) { ///
+  assert (width >= 0 && height >= 0);
+  assert (dx >= 0 && dy >= 0);
+  BlurStream bs = malloc(sizeof(struct blurstream));
+  if (bs == NULL) {
+    errCause = "Memory allocation failed";
+    errno = 12;
+    return NULL;
+  }
+  bs->width = width;
+  bs->height = height;
+  bs->dx = dx;
+  bs->dy = dy;
+  bs->win = NULL;
+  bs->top = 0;
+  bs->received = 0;
+  bs->emitted = 0;
+  return bs;
+}
+
+/// Destroy a blur stream.
+///   bsp : address of a BlurStream variable.
+/// If (*bsp)==NULL, no operation is performed.
+/// Ensures: (*bsp)==NULL.
+void ImageBlurStreamDestroy(BlurStream* bsp) { ///
+  assert (bsp != NULL);
+  if (*bsp != NULL) {
+    ImageDestroy(&(*bsp)->win);
+    free(*bsp);
+    *bsp = NULL;
+  }
+}
+
+/// Feed the next strip of input rows to a blur stream.
+/// Requires: strip has the width of the image and no more rows than are
+/// still missing.  The strip is not modified.
+/// Returns a new image with the next rows of the blurred image that can
+/// already be computed (possibly 0 rows): each output row needs the dy
+/// input rows below it, so the output lags dy rows behind the input,
+/// and the last strip pushed flushes all remaining rows.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBlurStreamPush(BlurStream bs, Image strip) { ///
+  assert (bs != NULL);
+  assert (strip != NULL);
+  assert (strip->width == bs->width);
+  assert (strip->height <= bs->height - bs->received);
+  REGION();
+  int w = bs->width;
+
+  //Linhas de entrada ainda necessárias: a partir de (emitted - dy)
+  int top = bs->emitted - bs->dy > 0 ? bs->emitted - bs->dy : 0;
+  int received = bs->received + strip->height;
+  //Nova janela: linhas [top, received) = linhas guardadas + a nova faixa
+  Image win = imageNew(w, received - top, strip->maxval, 0);
+  if (win == NULL) return NULL;
+  int kept = bs->received - top;
+  for (int y = 0; y < kept; y++) {
+    memcpy(ROW(win, y), ROW(bs->win, top - bs->top + y), (size_t)w);
+  }
+  for (int y = 0; y < strip->height; y++) {
+    memcpy(ROW(win, kept + y), ROW(strip, y), (size_t)w);
+  }
+  PIXMEM += (unsigned long)(received - top) * w;
+
+  //Linhas de saída completas: cada uma precisa de dy linhas abaixo, exceto no fim da imagem
+  int end = received == bs->height ? received : received - bs->dy;
+  if (end < bs->emitted) end = bs->emitted;
+  Image out = imageNew(w, end - bs->emitted, strip->maxval, 0);
+  if (out == NULL || !blurParallel(win, bs->dx, bs->dy, bs->emitted - top, end - top, out->pixel, out->stride)) {
+    errsave = errno;
+    ImageDestroy(&out);
+    ImageDestroy(&win);
+    errno = errsave;
+    return NULL;
+  }
+
+  //Substitui a janela anterior
+  ImageDestroy(&bs->win);
+  bs->win = win;
+  bs->top = top;
+  bs->received = received;
+  bs->emitted = end;
+  return out;
 }
 
@@ -13,16 +13,27 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include "image1bit.h"
 
 // Type for pixel levels
 typedef uint8_t uint8;
 
+// Type for pixel counts (histograms): images may have more than 2^32 pixels
+typedef uint64_t uint64;
+
 // Maximum value you can store in a pixel (maximum maxval accepted)
 extern const uint8 PixMax;
 
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type ImageStream is a pointer to a PGM file read or written in strips
+typedef struct imagestream *ImageStream;
+
+// Type BlurStream is a pointer to the state of a blur applied to strips
+typedef struct blurstream *BlurStream;
+
 /// Error handling functions
 
 /// Error cause.
@@ -36,15 +47,34 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, set names of counters and select the vector instruction set
+/// used by pixel kernels.  (Instrumentation is calibrated when first needed.)
 void ImageInit(void) ;
 
+/// Set the number of threads used by image operations.
+/// n == 0 selects the number of online processors (default: 1 thread).
+/// Results are identical whatever the number of threads.
+/// Requires: n >= 0.
+void ImageSetThreads(int n) ;
+
+/// Get the number of threads used by image operations.
+int ImageThreads(void) ;
+
+/// Limit the total size of the pixel blocks kept for reuse after images
+/// are destroyed (default: 256 MiB).  0 disables reuse.
+/// Destroyed images return their pixel blocks to a pool, and new images
+/// of similar sizes reuse them, avoiding fresh allocations (and the
+/// zeroing of fresh pages) in pipelines.
+/// Blocks kept by the calling thread are released down to the new limit.
+void ImageSetPoolLimit(size_t bytes) ;
+
 /// Image management functions
 
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
 /// Requires: width and height must be non-negative, maxval > 0.
+/// The number of pixels is only limited by memory (it may exceed 2^32).
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
@@ -54,10 +84,28 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
+/// Destroying a view does not affect its owner.  Destroying an image that
+/// still has views keeps its pixels alive until the last view is destroyed.
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Create a view of a rectangular part of img.
+/// The rectangle is specified by the top left corner coords (x, y) and
+/// width w and height h.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// The view shares the pixels of img: changing one changes the other.
+/// Views may be used wherever an image is expected, and views of views
+/// are allowed.  img and the view may be destroyed in any order.
+/// Operations on two images (paste, blend) must not be given overlapping
+/// views of the same image.
+///
+/// On success, a new view is returned.
+/// (The caller is responsible for destroying the returned view!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -67,6 +115,20 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Flags for ImageMap.
+#define IMAGE_MAP_PRIVATE  0  // image may be modified (copy-on-write)
+#define IMAGE_MAP_READONLY 1  // image must not be modified in-place
+
+/// Map a raw PGM file into memory, without reading or copying the pixels.
+/// Only 8 bit PGM files are accepted.
+///   flags : IMAGE_MAP_PRIVATE or IMAGE_MAP_READONLY.
+/// The file itself is never modified.
+/// With IMAGE_MAP_READONLY, in-place operations must not be applied.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMap(const char* filename, int flags) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -91,8 +153,25 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// For an empty image, both are set to 0.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Histogram
+/// On return, hist[v] is the number of pixels with gray level v,
+/// for v in [0, 255].
+void ImageHistogram(Image img, uint64 hist[256]) ;
+
+/// Extended pixel stats, in a single pass over the pixels.
+/// On return,
+/// *min and *max are set as in ImageStats,
+/// *mean is set to the mean gray level,
+/// *variance is set to the variance of the gray levels (population
+/// variance: mean squared deviation from the mean),
+/// hist is set as in ImageHistogram.
+/// Any of the pointers may be NULL, if that result is not wanted.
+/// For an empty image, all results are 0.
+void ImageStatsEx(Image img, uint8* min, uint8* max, double* mean, double* variance, uint64 hist[256]) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -135,6 +214,45 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Lookup tables
+
+/// Any transformation of pixel levels is a function of the level alone
+/// and may be stored as a table lut, where lut[v] is the new level of
+/// pixels with level v.  Sequences of transformations may be composed
+/// into a single table and applied in a single pass over the image.
+
+/// Apply a lookup table to image: pixels with level v get level lut[v].
+void ImageApplyLUT(Image img, const uint8 lut[256]) ;
+
+/// Fill lut with the identity transformation.
+void ImageLUTIdentity(uint8 lut[256]) ;
+
+/// Fill lut with the transformation done by ImageNegative,
+/// ImageThreshold or ImageBrighten on an image with the given maxval.
+void ImageLUTNegative(uint8 lut[256], uint8 maxval) ;
+void ImageLUTThreshold(uint8 lut[256], uint8 thr, uint8 maxval) ;
+void ImageLUTBrighten(uint8 lut[256], double factor, uint8 maxval) ;
+
+/// Compose two tables: lut becomes "apply first, then second".
+/// lut may be the same array as first or second.
+void ImageLUTCompose(uint8 lut[256], const uint8 first[256], const uint8 second[256]) ;
+
+/// Bitmaps
+
+/// Bilevel images may be stored packed, 8 pixels per byte (image1bit.h).
+/// Success and failure are treated as in ImageCreate.
+
+/// Convert image to a bitmap, as ImageThreshold would:
+/// pixels with level<thr become black (set), the others white (clear).
+/// The image is not modified.  To pack the result of ImageThreshold(img, t)
+/// (levels 0 and maxval), use any thr in [1, maxval].
+Bitmap ImageToBitmap(Image img, uint8 thr) ;
+
+/// Convert bitmap to a new image with the given maxval:
+/// black (set) pixels get level 0, white (clear) pixels get level maxval.
+/// Requires: maxval > 0.
+Image ImageFromBitmap(Bitmap bmp, uint8 maxval) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +273,20 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image clockwise.
+/// Returns a version of the image rotated 90 degrees clockwise.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateClockwise(Image img) ;
+
+/// Rotate an image 180 degrees, in place.
+/// Pixel (x, y) moves to (width-1-x, height-1-y).
+/// This needs no extra memory and cannot fail.
+void ImageRotate180(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -194,17 +326,59 @@ void ImagePaste(Image img1, int x, int y, Image img2) ;
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// Blend an image into a larger image, with a per-pixel alpha mask.
+/// Blend img2 into position (x, y) of img1, using alpha = m/maxval(mask)
+/// for each pixel, where m is the corresponding pixel of mask:
+/// each pixel p of img1 under pixel q of img2 becomes
+/// alpha*q + (1-alpha)*p, rounded to the nearest integer (computed
+/// exactly, in integers) and limited to maxval(img1).
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img2 must fit inside img1 at position (x, y), and mask must
+/// have the same size as img2.
+void ImageBlendMask(Image img1, int x, int y, Image img2, Image mask) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
-/// Returns 0, otherwise.
+/// Returns 0, otherwise (including when img2 does not fit inside img1
+/// at (x, y)).
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// The first match in raster order (top to bottom, left to right) is
+/// returned.  Only positions where img2 fits inside img1 are considered.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate all occurrences of a subimage inside another image.
+/// Searches for img2 inside img1, and stores the positions of the first
+/// max matches, in raster order (top to bottom, left to right), in
+/// (xs[0], ys[0]), (xs[1], ys[1]), ...
+/// Only positions where img2 fits inside img1 are considered.
+/// The search is split in bands of rows that run in parallel, and stops
+/// early once max matches are known; the result does not depend on the
+/// number of threads.
+/// Requires: max >= 0, and xs and ys have room for max positions.
+/// On success, returns the number of matches stored (at most max).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateAll(Image img1, Image img2, int* xs, int* ys, int max) ;
+
+/// Find the best match of a template by normalized cross-correlation.
+/// Searches for img2 inside img1, scoring each position (x, y) where img2
+/// fits with the normalized cross-correlation (Pearson correlation) of
+/// img2 and the subimage of img1 at (x, y), in [-1, 1], so that matches
+/// are found despite noise and changes in brightness and contrast.
+/// Positions where either image has no variation score 0.
+/// Small templates are compared directly; larger ones use FFTs,
+/// in O(N log N) time.
+/// On success, returns 1 and sets (*px, *py) to the position with the
+/// highest score (the first in raster order, if tied) and *pscore to it.
+/// If img2 is empty or does not fit inside img1, returns 0 and leaves
+/// (*px, *py, *pscore) untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageMatchNCC(Image img1, Image img2, int* px, int* py, double* pscore) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
@@ -213,4 +387,69 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 /// The image is changed in-place.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Strip streaming
+
+/// These functions process images too large to fit in memory, as a
+/// sequence of strips: images with the full width and a few rows each.
+/// Point operations (ImageNegative, ImageThreshold, ImageBrighten) may be
+/// applied to each strip directly; blurs go through a BlurStream.
+
+/// Open a raw PGM file for reading in strips.
+/// On success, a new stream is returned, positioned at row 0.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamOpen(const char* filename) ;
+
+/// Create a raw PGM file with the given size, to be written in strips.
+/// Requires: width and height must be non-negative, maxval > 0.
+/// On success, a new stream is returned.
+/// (The caller is responsible for closing the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageStream ImageStreamCreate(const char* filename, int width, int height, uint8 maxval) ;
+
+/// Close the stream pointed to by (*sp).
+/// Ensures: (*sp)==NULL.
+/// Returns nonzero on success.
+/// A stream being written fails if not all rows were written.
+int ImageStreamClose(ImageStream* sp) ;
+
+/// Get size and maximum gray level of the streamed image
+int ImageStreamWidth(ImageStream s) ;
+int ImageStreamHeight(ImageStream s) ;
+int ImageStreamMaxval(ImageStream s) ;
+
+/// Read the next strip of at most nrows rows (0 rows after the end).
+/// Requires: nrows > 0.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageStreamRead(ImageStream s, int nrows) ;
+
+/// Append the rows of strip to the file.
+/// Requires: strip has the width of the stream and at most the number of
+/// rows still missing.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately.
+int ImageStreamWrite(ImageStream s, Image strip) ;
+
+/// Create the state for blurring, with a (2dx+1)x(2dy+1) mean filter,
+/// an image of the given size that arrives in strips.
+/// Requires: width, height, dx and dy must be non-negative.
+/// On success, a new blur stream is returned.
+/// (The caller is responsible for destroying the returned stream!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BlurStream ImageBlurStreamCreate(int width, int height, int dx, int dy) ;
+
+/// Destroy the blur stream pointed to by (*bsp).
+/// Ensures: (*bsp)==NULL.
+void ImageBlurStreamDestroy(BlurStream* bsp) ;
+
+/// Feed the next strip of input rows (in order) to a blur stream.
+/// Returns a new image with the blurred rows completed by this strip
+/// (possibly 0 rows).  Output lags dy rows behind the input; pushing the
+/// last strip flushes the remaining rows.  The strip is not modified.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageBlurStreamPush(BlurStream bs, Image strip) ;
+
 #endif
@@ -0,0 +1,495 @@
+// imageBench - Performance benchmarks of the image8bit module.
+//
+// Runs every image operation on synthetic images of several kinds
+// (noise, gradient, sparse, binary) and sizes, with a warm-up run and
+// repetitions, and reports the median throughput (pixels of the input
+// image per second) and the instrumentation counters of one run.
+// Each run works on a fresh copy of the input image, made before the
+// run is timed, so in-place operations and cached results (such as
+// those of ImageLocateSubImage) do not affect later runs.
+//
+// Results may be saved as a baseline (JSON) and compared with one made
+// with the same number of threads: the program fails (exit status 1) if
+// some operation is slower than its baseline by more than a threshold.
+// Baselines and comparisons keep the best of a few medians (see BEST_OF).
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [OPTION...]\n"
+    "Benchmark the operations of the image8bit module.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -r REPS         Number of timed samples of each operation (default 7)\n"
+    "  -s SIZE,...     Sizes of the (square) images (default 256,1024)\n"
+    "  -j THREADS      Number of threads (default 1; 0: all processors)\n"
+    "  -f TEXT         Run only the operations whose name contains TEXT\n"
+    "  -b FILE         Compare with the baseline in FILE, and fail if some\n"
+    "                  operation is slower than its baseline by more than\n"
+    "                  the threshold\n"
+    "  -t PERCENT      Threshold for -b (default 25)\n"
+    "  -w FILE         Write the results to FILE, as a new baseline\n"
+    ;
+
+// Minimum duration of a timed sample: fast operations are repeated
+// within a sample until it lasts this long (in seconds)
+#define MIN_SAMPLE 1e-3
+
+// Each throughput is the best (fastest) of up to BEST_OF medians, as this
+// machine's speed varies.  Baselines always take all of them; comparisons
+// stop as soon as the operation is not slower than its baseline (so an
+// apparent regression must reproduce BEST_OF times).  Both thus estimate
+// the same statistic, and the gate is not biased toward passing.
+#define BEST_OF 4
+
+// Maximum number of sizes
+#define MAXSIZES 8
+
+// Side of the subimages searched, and of the alpha mask
+#define SUB 32
+
+// Input data of the operations
+struct input {
+  Image img;    // image (each run gets a copy)
+  Image sub;    // subimage of img, near its bottom right corner
+  Image mask;   // alpha mask of the size of sub
+  Bitmap bmp;   // img thresholded at half its maxval
+};
+
+// An operation applied to img, a copy of in->img
+struct op {
+  const char* name;
+  void (*run)(Image img, const struct input* in);
+};
+
+// Operations
+
+static void opCreate(Image img, const struct input* in) {
+  Image r = ImageCreate(ImageWidth(img), ImageHeight(img), ImageMaxval(img));
+  ImageDestroy(&r);
+}
+
+static void opStats(Image img, const struct input* in) {
+  uint8 min, max;
+  ImageStats(img, &min, &max);
+}
+
+static void opHistogram(Image img, const struct input* in) {
+  uint64 hist[256];
+  ImageHistogram(img, hist);
+}
+
+static void opStatsEx(Image img, const struct input* in) {
+  uint8 min, max;
+  double mean, variance;
+  ImageStatsEx(img, &min, &max, &mean, &variance, NULL);
+}
+
+static void opNegative(Image img, const struct input* in) {
+  ImageNegative(img);
+}
+
+static void opThreshold(Image img, const struct input* in) {
+  ImageThreshold(img, 100);
+}
+
+static void opBrighten(Image img, const struct input* in) {
+  ImageBrighten(img, 1.3);
+}
+
+static void opApplyLUT(Image img, const struct input* in) {
+  uint8 lut[256];
+  ImageLUTBrighten(lut, 0.7, ImageMaxval(img));
+  ImageApplyLUT(img, lut);
+}
+
+static void opToBitmap(Image img, const struct input* in) {
+  Bitmap bmp = ImageToBitmap(img, 128);
+  BitmapDestroy(&bmp);
+}
+
+static void opFromBitmap(Image img, const struct input* in) {
+  Image r = ImageFromBitmap(in->bmp, ImageMaxval(img));
+  ImageDestroy(&r);
+}
+
+static void opRotate(Image img, const struct input* in) {
+  Image r = ImageRotate(img);
+  ImageDestroy(&r);
+}
+
+static void opRotateClockwise(Image img, const struct input* in) {
+  Image r = ImageRotateClockwise(img);
+  ImageDestroy(&r);
+}
+
+static void opRotate180(Image img, const struct input* in) {
+  ImageRotate180(img);
+}
+
+static void opMirror(Image img, const struct input* in) {
+  Image r = ImageMirror(img);
+  ImageDestroy(&r);
+}
+
+static void opCrop(Image img, const struct input* in) {
+  Image r = ImageCrop(img, 1, 1, ImageWidth(img) - 2, ImageHeight(img) - 2);
+  ImageDestroy(&r);
+}
+
+static void opPaste(Image img, const struct input* in) {
+  // Paste (a view of) the input image, shifted: covers most of img
+  Image v = ImageView(in->img, 0, 0, ImageWidth(img) - 1, ImageHeight(img) - 1);
+  ImagePaste(img, 1, 1, v);
+  ImageDestroy(&v);
+}
+
+static void opBlend(Image img, const struct input* in) {
+  Image v = ImageView(in->img, 0, 0, ImageWidth(img) - 1, ImageHeight(img) - 1);
+  ImageBlend(img, 1, 1, v, 0.33);
+  ImageDestroy(&v);
+}
+
+static void opBlendMask(Image img, const struct input* in) {
+  for (int y = 0; y + SUB <= ImageHeight(img); y += SUB) {
+    for (int x = 0; x + SUB <= ImageWidth(img); x += SUB) {
+      ImageBlendMask(img, x, y, in->sub, in->mask);
+    }
+  }
+}
+
+static void opMatchSubImage(Image img, const struct input* in) {
+  int n = 0;
+  for (int y = 0; y + SUB <= ImageHeight(img); y += SUB) {
+    for (int x = 0; x + SUB <= ImageWidth(img); x += SUB) {
+      n += ImageMatchSubImage(img, x, y, in->sub);
+    }
+  }
+  (void)n;
+}
+
+static void opLocateSubImage(Image img, const struct input* in) {
+  int x, y;
+  ImageLocateSubImage(img, &x, &y, in->sub);
+}
+
+static void opLocateAll(Image img, const struct input* in) {
+  int xs[16], ys[16];
+  ImageLocateAll(img, in->sub, xs, ys, 16);
+}
+
+static void opMatchNCC(Image img, const struct input* in) {
+  int x, y;
+  double score;
+  ImageMatchNCC(img, in->sub, &x, &y, &score);
+}
+
+static void opBlur(Image img, const struct input* in) {
+  ImageBlur(img, 3, 3);
+}
+
+static void opBlurLarge(Image img, const struct input* in) {
+  ImageBlur(img, 30, 30);
+}
+
+static const struct op ops[] = {
+  {"ImageCreate", opCreate},
+  {"ImageStats", opStats},
+  {"ImageHistogram", opHistogram},
+  {"ImageStatsEx", opStatsEx},
+  {"ImageNegative", opNegative},
+  {"ImageThreshold", opThreshold},
+  {"ImageBrighten", opBrighten},
+  {"ImageApplyLUT", opApplyLUT},
+  {"ImageToBitmap", opToBitmap},
+  {"ImageFromBitmap", opFromBitmap},
+  {"ImageRotate", opRotate},
+  {"ImageRotateClockwise", opRotateClockwise},
+  {"ImageRotate180", opRotate180},
+  {"ImageMirror", opMirror},
+  {"ImageCrop", opCrop},
+  {"ImagePaste", opPaste},
+  {"ImageBlend", opBlend},
+  {"ImageBlendMask", opBlendMask},
+  {"ImageMatchSubImage", opMatchSubImage},
+  {"ImageLocateSubImage", opLocateSubImage},
+  {"ImageLocateAll", opLocateAll},
+  {"ImageMatchNCC", opMatchNCC},
+  {"ImageBlur 3,3", opBlur},
+  {"ImageBlur 30,30", opBlurLarge},
+};
+
+#define NUMOPS ((int)(sizeof(ops) / sizeof(ops[0])))
+
+// Synthetic images
+
+static const char* kinds[] = {"noise", "gradient", "sparse", "binary"};
+
+#define NUMKINDS ((int)(sizeof(kinds) / sizeof(kinds[0])))
+
+// Pseudo-random numbers (the same in every run)
+static unsigned long long seed;
+
+static unsigned rnd(void) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned)(seed >> 33);
+}
+
+// Create a size x size image of the given kind
+static Image makeImage(int kind, int size) {
+  Image img = ImageCreate(size, size, 255);
+  if (img == NULL) return NULL;
+  seed = (unsigned long long)kind * 1000003 + (unsigned long long)size;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      uint8 level;
+      switch (kind) {
+      case 0:  // uniform noise
+        level = (uint8)(rnd() & 255);
+        break;
+      case 1:  // smooth gradient
+        level = (uint8)(255 * (x + y) / (2 * size - 1));
+        break;
+      case 2:  // white, with about 1% dark pixels
+        level = rnd() % 100 == 0 ? (uint8)(rnd() % 64) : 255;
+        break;
+      default:  // black and white blocks of 8x8 pixels
+        level = ((unsigned)(x / 8 * 7919 + y / 8 * 104729) * 2654435761u) >> 31 ? 255 : 0;
+      }
+      ImageSetPixel(img, x, y, level);
+    }
+  }
+  return img;
+}
+
+// Results
+
+struct result {
+  char op[64];
+  char kind[16];
+  int size;
+  double mpix;            // best median throughput (millions of pixels per second)
+  unsigned long pixmem;   // counters of one run
+  unsigned long compare;
+};
+
+// Time one run of op on a copy of in->img: sets count to the changes of
+// the counters, and returns the time (seconds).
+static double runOnce(const struct op* op, const struct input* in, unsigned long count[NUMCOUNTERS]) {
+  Image img = ImageCrop(in->img, 0, 0, ImageWidth(in->img), ImageHeight(in->img));
+  if (img == NULL) error(2, errno, "Copying image: %s", ImageErrMsg());
+  unsigned long before[NUMCOUNTERS];
+  InstrSum(before);
+  double t0 = wall_time();
+  op->run(img, in);
+  double t = wall_time() - t0;
+  InstrSum(count);
+  for (int i = 0; i < NUMCOUNTERS; i++) count[i] -= before[i];
+  ImageDestroy(&img);
+  return t;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Measure op: a warm-up run, then reps samples (of one or more runs each).
+// Returns the median time of a run, and sets count as runOnce.
+static double measure(const struct op* op, const struct input* in, int reps, unsigned long count[NUMCOUNTERS]) {
+  double warm = runOnce(op, in, count);
+  int runs = warm < MIN_SAMPLE ? (int)(MIN_SAMPLE / (warm > 1e-7 ? warm : 1e-7)) + 1 : 1;
+  if (runs > 1000) runs = 1000;
+  double times[reps];
+  for (int s = 0; s < reps; s++) {
+    double t = 0.0;
+    for (int k = 0; k < runs; k++) t += runOnce(op, in, count);
+    times[s] = t / runs;
+  }
+  qsort(times, reps, sizeof(double), cmpDouble);
+  return reps % 2 ? times[reps / 2] : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+}
+
+// Read the results of a baseline file written by writeResults, and the
+// number of threads used in *threads (-1 if not found).
+// Returns the number of results read into res (at most max).
+static int readBaseline(const char* filename, struct result* res, int max, int* threads) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) error(2, errno, "Opening %s", filename);
+  char line[512];
+  int n = 0;
+  *threads = -1;
+  while (n < max && fgets(line, sizeof(line), f) != NULL) {
+    char* t = strstr(line, "\"threads\": ");
+    if (t != NULL && *threads < 0) sscanf(t, "\"threads\": %d", threads);
+    char* p = strstr(line, "{\"op\": ");
+    if (p == NULL) continue;
+    struct result* r = &res[n];
+    if (sscanf(p, "{\"op\": \"%63[^\"]\", \"kind\": \"%15[^\"]\", \"size\": %d, \"mpix\": %lf, \"pixmem\": %lu, \"compare\": %lu",
+               r->op, r->kind, &r->size, &r->mpix, &r->pixmem, &r->compare) == 6) {
+      n++;
+    }
+  }
+  fclose(f);
+  return n;
+}
+
+// Write the results as a baseline file (JSON, one result per line)
+static void writeResults(const char* filename, const struct result* res, int n, int reps, int threads) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) error(2, errno, "Creating %s", filename);
+  fprintf(f, "{\"reps\": %d, \"threads\": %d,\n \"results\": [\n", reps, threads);
+  for (int i = 0; i < n; i++) {
+    fprintf(f, "  {\"op\": \"%s\", \"kind\": \"%s\", \"size\": %d, \"mpix\": %.3f, \"pixmem\": %lu, \"compare\": %lu}%s\n",
+            res[i].op, res[i].kind, res[i].size, res[i].mpix, res[i].pixmem, res[i].compare, i + 1 < n ? "," : "");
+  }
+  fprintf(f, " ]}\n");
+  if (fclose(f) != 0) error(2, errno, "Writing %s", filename);
+}
+
+// Find the result for (op, kind, size) in res[0..n), or NULL
+static const struct result* findResult(const struct result* res, int n, const struct result* r) {
+  for (int i = 0; i < n; i++) {
+    if (res[i].size == r->size && strcmp(res[i].op, r->op) == 0 && strcmp(res[i].kind, r->kind) == 0)
+      return &res[i];
+  }
+  return NULL;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  int reps = 7;
+  int sizes[MAXSIZES] = {256, 1024};
+  int nsizes = 2;
+  int threads = 1;
+  double threshold = 25.0;
+  const char* filter = NULL;
+  const char* baseline = NULL;
+  const char* output = NULL;
+
+  for (int k = 1; k < ac; k++) {
+    if (strcmp(av[k], "-h") == 0) {
+      printf("%s", USAGE);
+      return 0;
+    }
+    if (av[k][0] != '-' || av[k][1] == '\0' || av[k][2] != '\0' || strchr("rsjfbtw", av[k][1]) == NULL) {
+      error(1, 0, "Invalid option: %s\n%s", av[k], USAGE);
+    }
+    if (k + 1 >= ac) error(1, 0, "Missing operand of %s", av[k]);
+    char opt = av[k][1];
+    char* arg = av[++k];
+    int ok = 1;
+    switch (opt) {
+    case 'r': ok = sscanf(arg, "%d", &reps) == 1 && reps > 0; break;
+    case 'j': ok = sscanf(arg, "%d", &threads) == 1 && threads >= 0; break;
+    case 't': ok = sscanf(arg, "%lf", &threshold) == 1 && threshold >= 0.0; break;
+    case 'f': filter = arg; break;
+    case 'b': baseline = arg; break;
+    case 'w': output = arg; break;
+    case 's':
+      nsizes = 0;
+      for (char* p = strtok(arg, ","); ok && p != NULL; p = strtok(NULL, ",")) {
+        ok = nsizes < MAXSIZES && sscanf(p, "%d", &sizes[nsizes]) == 1 && sizes[nsizes] >= 2 * SUB;
+        nsizes++;
+      }
+      break;
+    }
+    if (!ok) error(1, 0, "Invalid operand of -%c: %s", opt, arg);
+  }
+
+  ImageInit();
+  ImageSetThreads(threads);
+
+  int maxres = nsizes * NUMKINDS * NUMOPS;
+  struct result* res = calloc(maxres, sizeof(struct result));
+  struct result* base = calloc(maxres, sizeof(struct result));
+  if (res == NULL || base == NULL) error(2, errno, "Out of memory");
+  int nbase = 0;
+  if (baseline != NULL) {
+    int bthreads;
+    nbase = readBaseline(baseline, base, maxres, &bthreads);
+    if (bthreads != ImageThreads())
+      error(1, 0, "Baseline %s was made with %d threads, not %d: not comparable", baseline, bthreads, ImageThreads());
+  }
+  int n = 0, slower = 0;
+
+  printf("# %d threads, %d samples, %s\n", ImageThreads(), reps,
+         baseline != NULL ? "compared with baseline" : "no baseline");
+  printf("#%-21s %-9s %5s %10s %10s %12s %12s", "op", "kind", "size", "ms", "MPix/s", "pixmem", "compare");
+  if (baseline != NULL) printf(" %10s %8s", "baseline", "change");
+  printf("\n");
+  for (int s = 0; s < nsizes; s++) {
+    int size = sizes[s];
+    for (int kind = 0; kind < NUMKINDS; kind++) {
+      struct input in;
+      in.img = makeImage(kind, size);
+      in.mask = makeImage(0, SUB);
+      if (in.img == NULL || in.mask == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+      in.sub = ImageCrop(in.img, size - SUB - 7, size - SUB - 5, SUB, SUB);
+      in.bmp = ImageToBitmap(in.img, 128);
+      if (in.sub == NULL || in.bmp == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+
+      for (int o = 0; o < NUMOPS; o++) {
+        if (filter != NULL && strstr(ops[o].name, filter) == NULL) continue;
+        unsigned long count[NUMCOUNTERS];
+        double t = measure(&ops[o], &in, reps, count);
+        struct result* r = &res[n++];
+        snprintf(r->op, sizeof(r->op), "%s", ops[o].name);
+        snprintf(r->kind, sizeof(r->kind), "%s", kinds[kind]);
+        r->size = size;
+        r->pixmem = count[0];
+        r->compare = count[1];
+        const struct result* b = findResult(base, nbase, r);
+        // The best of BEST_OF medians (see there)
+        for (int m = 1; m < BEST_OF; m++) {
+          if (output == NULL && (b == NULL || (double)size * size / t / 1e6 >= b->mpix * (1.0 - threshold / 100.0)))
+            break;
+          double t2 = measure(&ops[o], &in, reps, count);
+          if (t2 < t) t = t2;
+        }
+        r->mpix = (double)size * size / t / 1e6;
+        printf(" %-21s %-9s %5d %10.3f %10.1f %12lu %12lu", r->op, r->kind, size, t * 1e3, r->mpix, r->pixmem, r->compare);
+        if (baseline != NULL) {
+          if (b == NULL) {
+            printf(" %10s", "new");
+          } else {
+            double change = 100.0 * (r->mpix / b->mpix - 1.0);
+            printf(" %10.1f %+7.1f%%", b->mpix, change);
+            if (change < -threshold) {
+              printf(" SLOWER");
+              slower++;
+            }
+            if (b->pixmem != r->pixmem || b->compare != r->compare) printf(" (counts changed)");
+          }
+        }
+        printf("\n");
+        fflush(stdout);
+      }
+      ImageDestroy(&in.img);
+      ImageDestroy(&in.sub);
+      ImageDestroy(&in.mask);
+      BitmapDestroy(&in.bmp);
+    }
+  }
+
+  if (output != NULL) writeResults(output, res, n, reps, ImageThreads());
+  if (baseline != NULL) {
+    printf("# %d of %d results slower than the baseline by more than %g%%\n", slower, n, threshold);
+  }
+  free(res);
+  free(base);
+  return slower > 0 ? 1 : 0;
+}
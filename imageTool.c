@@ -9,9 +9,14 @@
 // João Manuel Rodrigues <jmr@ua.pt>
 // 2023
 
+#if defined(__linux__)
+#define _GNU_SOURCE   // struct ucred, for SO_PEERCRED
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
@@ -19,8 +24,22 @@
 #include "image8bit.h"
 #include "instrumentation.h"
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool stream ROWS FILE [OPERATION [OPERAND...]] save FILE\n"
+    "       imageTool --serve SOCKET\n"
+    "       imageTool --connect SOCKET [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool --trace TRACE [FILE...] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -36,27 +55,77 @@ static const char* USAGE =
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
+    "  map FILE        Map PGM image file into memory, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  loadpbm FILE    Load PBM bitmap file (raw), creating new image with\n"
+    "                  black pixels 0 and white pixels 255\n"
+    "  savepbm FILE    Save CURR to PBM bitmap file (raw): levels below half\n"
+    "                  of maxval become black, the others white\n"
+    "  info            Show information on CURR (size, range, mean and\n"
+    "                  standard deviation)\n"
     "  tic             Reset instrumentation counters and times.\n"
-    "  toc             Print instrumentation counters and times.\n"
+    "  toc             Print instrumentation counters and times, in total\n"
+    "                  and for each image operation, and the efficiency of\n"
+    "                  copies, table lookups and rotations (the first toc on\n"
+    "                  a machine calibrates, which takes a few seconds)\n"
+    "  tocformat FMT   Print toc as text (default), csv or json\n"
+    "  events          Count hardware events (cycles, instructions, cache\n"
+    "                  and branch misses) and page faults, shown by toc\n"
+    "                  (use before threads)\n"
+    "  threads N       Use N threads in image operations (0: all processors)\n"
+    "  pool MB         Keep up to MB MiB of pixel memory of destroyed images\n"
+    "                  for reuse (0: none; default 256)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "                  (consecutive neg, thr and bri are done in a single pass)\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotatecw        Rotate CURR 90º clockwise, creating new image\n"
+    "  rotate180       Rotate CURR 180º (in place)\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  view X,Y,W,H    View a rectangle of CURR, sharing its pixels (new image)\n"
+    "  store NAME      Keep a copy of CURR under NAME, after the pipeline ends\n"
+    "  fetch NAME      Copy the image stored as NAME (new image)\n"
+    "  drop NAME       Forget the image stored as NAME\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
+    "  blendmask X,Y   Blend PRED into CURR at position (X,Y), using the image\n"
+    "                  before PRED as alpha mask (same size as PRED)\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  locateall MAX   Search PRED in CURR, print up to MAX matching positions\n"
+    "  match THRESH    Search PRED in CURR by normalized cross-correlation, print\n"
+    "                  best position and score if score >= THRESH, or NOTFOUND\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
     "\n"              
+    "STREAM MODE:\n"
+    "  Process FILE in strips of ROWS rows, so that images larger than memory\n"
+    "  can be handled.  Only neg, thr, bri and blur may be used and the\n"
+    "  pipeline must end with save.  Each blur keeps 2*DY extra rows.\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  --serve SOCKET runs a server on a Unix domain socket, and --connect SOCKET\n"
+    "  runs a pipeline there (without the startup cost of calibration), in the\n"
+    "  client's directory and with its output.  Stored images and settings\n"
+    "  (threads, pool, tocformat, events) persist between pipelines.\n"
+    "  Requests are serialized: pipelines run one at a time, each after the\n"
+    "  previous one ends, and a client that takes more than 10 seconds to send\n"
+    "  its request is dropped.  Only the user running the server may connect\n"
+    "  (the socket has mode 0600).  SIGINT or SIGTERM stop the server.\n"
+    "\n"
+    "TRACING:\n"
+    "  --trace TRACE (before the pipeline, also with --connect) records the\n"
+    "  pipeline in TRACE, in Chrome Trace Event format (JSON), for trace viewers\n"
+    "  (chrome://tracing, ui.perfetto.dev): each operation, with its operands\n"
+    "  and the size of CURR, the image functions it calls, with the changes\n"
+    "  of the counters, and the bands of each thread in parallel operations.\n"
+    "\n"
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
@@ -74,6 +143,11 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Operation not supported in stream mode",
+  "Image1bit failure: %s",
+  "No image with that name",
+  "Too many named images",
+  "Cannot write trace",
 };
 
 
@@ -85,13 +159,216 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Stream mode: av[0] is "stream", av[1] is ROWS, av[2] is the input FILE,
+// followed by point operations and blurs, and finally save FILE.
+// Returns an index into errors[].
+static int streamPipeline(int ac, char* av[]) {
+  // The stages of the pipeline
+  enum { NEG, THR, BRI, BLUR, LUT, SKIP };
+  const int M = 64;   // maximum number of stages
+  struct { int op; uint8 thr; double factor; int dx, dy; BlurStream bs; uint8 lut[256]; } stage[M];
+  int m = 0;          // number of stages
+  int rows;
+  int err = 0;
+
+  if (ac < 5) return 1;
+  if (sscanf(av[1], "%d", &rows) != 1 || rows <= 0) return 5;
+  int k = 3;
+  while (k < ac && strcmp(av[k], "save") != 0) {
+    if (m >= M) { return 3; }
+    if (strcmp(av[k], "neg") == 0) {
+      stage[m].op = NEG;
+    } else if (strcmp(av[k], "thr") == 0) {
+      if (++k >= ac) { return 1; }
+      if (sscanf(av[k], "%hhu", &stage[m].thr) != 1) { return 5; }
+      stage[m].op = THR;
+    } else if (strcmp(av[k], "bri") == 0) {
+      if (++k >= ac) { return 1; }
+      if (sscanf(av[k], "%lf", &stage[m].factor) != 1) { return 5; }
+      if (!(stage[m].factor >= 0.0)) { return 5; }   // precondition check!
+      stage[m].op = BRI;
+    } else if (strcmp(av[k], "blur") == 0) {
+      if (++k >= ac) { return 1; }
+      if (sscanf(av[k], "%d,%d", &stage[m].dx, &stage[m].dy) != 2) { return 5; }
+      if (stage[m].dx < 0 || stage[m].dy < 0) { return 5; }   // precondition check!
+      stage[m].op = BLUR;
+    } else {
+      return 8;
+    }
+    stage[m].bs = NULL;
+    m++;
+    k++;
   }
+  if (k + 1 >= ac) return 1;
+  if (k + 2 != ac) return 8;   // save must be the last operation
 
-  ImageInit();
+  fprintf(stderr, "Streaming %s -> %s in strips of %d rows\n", av[2], av[k+1], rows);
+  ImageStream in = ImageStreamOpen(av[2]);
+  if (in == NULL) return 4;
+  int w = ImageStreamWidth(in);
+  int h = ImageStreamHeight(in);
+  ImageStream out = ImageStreamCreate(av[k+1], w, h, (uint8)ImageStreamMaxval(in));
+  if (out == NULL) { ImageStreamClose(&in); return 4; }
+  // Compose each run of consecutive point operations into a single table
+  for (int i = 0; i < m; i++) {
+    int j = i;
+    while (j < m && stage[j].op != BLUR) j++;
+    if (j - i > 1) {
+      uint8 maxval = (uint8)ImageStreamMaxval(in);
+      uint8 lut[256];
+      ImageLUTIdentity(stage[i].lut);
+      for (int l = i; l < j; l++) {
+        switch (stage[l].op) {
+        case NEG: ImageLUTNegative(lut, maxval); break;
+        case THR: ImageLUTThreshold(lut, stage[l].thr, maxval); break;
+        case BRI: ImageLUTBrighten(lut, stage[l].factor, maxval); break;
+        }
+        ImageLUTCompose(stage[i].lut, stage[i].lut, lut);
+        stage[l].op = SKIP;
+      }
+      stage[i].op = LUT;
+    }
+    i = j;
+  }
+  for (int i = 0; i < m && err == 0; i++) {
+    if (stage[i].op == BLUR) {
+      stage[i].bs = ImageBlurStreamCreate(w, h, stage[i].dx, stage[i].dy);
+      if (stage[i].bs == NULL) err = 4;
+    }
+  }
+
+  // Read, process and write one strip at a time
+  while (err == 0) {
+    Image strip = ImageStreamRead(in, rows);
+    if (strip == NULL) { err = 4; break; }
+    if (ImageHeight(strip) == 0) { ImageDestroy(&strip); break; }
+    for (int i = 0; i < m && strip != NULL; i++) {
+      switch (stage[i].op) {
+      case NEG: ImageNegative(strip); break;
+      case THR: ImageThreshold(strip, stage[i].thr); break;
+      case BRI: ImageBrighten(strip, stage[i].factor); break;
+      case LUT: ImageApplyLUT(strip, stage[i].lut); break;
+      case SKIP: break;
+      case BLUR: {
+          Image blurred = ImageBlurStreamPush(stage[i].bs, strip);
+          ImageDestroy(&strip);
+          strip = blurred;
+        }
+        break;
+      }
+    }
+    if (strip == NULL) { err = 4; break; }
+    if (ImageStreamWrite(out, strip) == 0) { err = 4; }
+    ImageDestroy(&strip);
+  }
+
+  for (int i = 0; i < m; i++) {
+    ImageBlurStreamDestroy(&stage[i].bs);
+  }
+  ImageStreamClose(&in);
+  if (ImageStreamClose(&out) == 0 && err == 0) err = 4;
+  return err;
+}
+
+// Consecutive point operations (neg, thr, bri) on CURR are not applied
+// immediately: they are composed into a single lookup table, which is
+// applied in one pass over the image before the next operation of any
+// other kind (or at the end).
+struct pending {
+  int count;       // number of operations pending
+  uint8 lut[256];  // their composition
+  char op;         // the last one: 'n', 't' or 'b'
+  uint8 thr;
+  double factor;
+};
+
+static int isPointOp(const char* s) {
+  return strcmp(s, "neg") == 0 || strcmp(s, "thr") == 0 || strcmp(s, "bri") == 0;
+}
+
+// Add operation op (with operand thr or factor) to the pending ones
+static void addPointOp(struct pending* pp, Image img, char op, uint8 thr, double factor) {
+  uint8 maxval = (uint8)ImageMaxval(img);
+  uint8 lut[256];
+  switch (op) {
+  case 'n': ImageLUTNegative(lut, maxval); break;
+  case 't': ImageLUTThreshold(lut, thr, maxval); break;
+  case 'b': ImageLUTBrighten(lut, factor, maxval); break;
+  }
+  if (pp->count == 0) ImageLUTIdentity(pp->lut);
+  ImageLUTCompose(pp->lut, pp->lut, lut);
+  pp->count++;
+  pp->op = op;
+  pp->thr = thr;
+  pp->factor = factor;
+}
+
+// Apply the pending operations to img
+static void flushPointOps(struct pending* pp, Image img) {
+  if (pp->count == 1) {   // a single operation: its own kernel is faster
+    switch (pp->op) {
+    case 'n': ImageNegative(img); break;
+    case 't': ImageThreshold(img, pp->thr); break;
+    case 'b': ImageBrighten(img, pp->factor); break;
+    }
+  } else if (pp->count > 1) {
+    fprintf(stderr, "Applying %d point operations in a single pass\n", pp->count);
+    ImageApplyLUT(img, pp->lut);
+  }
+  pp->count = 0;
+}
+
+// Named images, kept by store (as private copies, which no operation
+// changes) until dropped or replaced.  In server mode they stay resident between pipelines.
+#define MAXNAMED 64
+static struct { char* name; Image img; } named[MAXNAMED];
+static int nnamed = 0;
+
+// Index of the image named name in named[], or -1 if none
+static int findNamed(const char* name) {
+  for (int i = 0; i < nnamed; i++) {
+    if (strcmp(named[i].name, name) == 0) return i;
+  }
+  return -1;
+}
+
+// Forget the image named[i]
+static void dropNamed(int i) {
+  ImageDestroy(&named[i].img);
+  free(named[i].name);
+  named[i] = named[--nnamed];
+}
+
+// End the span of operation av[k0] (with operands up to av[k]) in the trace,
+// noting CURR (img[n-1]) or failure.
+static void endStage(char* av[], int k0, int k, Image img[], int n, int failed) {
+  if (!InstrTracing) return;
+  char detail[96];
+  int len = 0;
+  for (int i = k0 + 1; i <= k && len < (int)sizeof(detail); i++)
+    len += snprintf(detail + len, sizeof(detail) - len, i < k ? "%s " : "%s; ", av[i]);
+  if (len >= (int)sizeof(detail)) len = sizeof(detail) - 1;
+  if (failed)
+    snprintf(detail + len, sizeof(detail) - len, "(failed)");
+  else if (n > 0)
+    snprintf(detail + len, sizeof(detail) - len, "CURR I%d %dx%d%s", n-1,
+             ImageWidth(img[n-1]), ImageHeight(img[n-1]), isPointOp(av[k0]) ? " (pending)" : "");
+  InstrSpanEnd(av[k0], detail);
+}
+
+// Run the pipeline of operations av[1], ..., av[ac-1].
+// Returns an index into errors[].
+static int runPipeline(int ac, char* av[]) {
+  if (strcmp(av[1], "--trace") == 0) {
+    if (ac < 4) return 1;
+    if (!InstrTraceOpen(av[2])) return 12;
+    int err = runPipeline(ac-2, av+2);
+    if (!InstrTraceClose() && err == 0) err = 12;
+    return err;
+  }
+  if (strcmp(av[1], "stream") == 0) {
+    return streamPipeline(ac-1, av+1);
+  }
 
   int err = 0;
   int x, y, w, h;
@@ -101,40 +378,72 @@ int main(int ac, char* av[]) {
   Image img[N];     // the images
   int n = 0;          // number of images created
 
+  struct pending pend = { .count = 0 };   // point operations not yet applied
+
   int k = 1;
+  int k0 = k;    // the operation (when tracing, each is a span)
   while (k < ac) {
+    if (pend.count > 0 && !isPointOp(av[k])) {
+      flushPointOps(&pend, img[n-1]);
+    }
+    k0 = k;
+    InstrSpanBegin(1);
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
       uint8 min, max;
+      double mean, variance;
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
+      ImageStatsEx(img[n-1], &min, &max, &mean, &variance, NULL);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      printf("# Mean: %.3f\n# Standard deviation: %.3f\n", mean, sqrt(variance));
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+    } else if (strcmp(av[k], "events") == 0) {
+      int events = InstrEventsOpen();
+      fprintf(stderr, "Counting %d hardware and kernel events\n", events);
+    } else if (strcmp(av[k], "tocformat") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (strcmp(av[k], "text") == 0) InstrFormat = INSTR_TEXT;
+      else if (strcmp(av[k], "csv") == 0) InstrFormat = INSTR_CSV;
+      else if (strcmp(av[k], "json") == 0) InstrFormat = INSTR_JSON;
+      else { err = 5; break; }
+    } else if (strcmp(av[k], "threads") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int threads;
+      if (sscanf(av[k], "%d", &threads) != 1 || threads < 0) { err = 5; break; }
+      ImageSetThreads(threads);
+      fprintf(stderr, "Using %d threads\n", ImageThreads());
+    } else if (strcmp(av[k], "pool") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int mb;
+      if (sscanf(av[k], "%d", &mb) != 1 || mb < 0) { err = 5; break; }
+      ImageSetPoolLimit((size_t)mb << 20);
+      fprintf(stderr, "Pooling up to %d MiB\n", mb);
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      addPointOp(&pend, img[n-1], 'n', 0, 0.0);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
       fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      addPointOp(&pend, img[n-1], 't', thr, 0.0);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
+      if (!(factor >= 0.0)) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      addPointOp(&pend, img[n-1], 'b', 0, factor);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
@@ -151,6 +460,17 @@ int main(int ac, char* av[]) {
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "rotatecw") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating I%d clockwise -> I%d\n", n-1, n);
+      img[n] = ImageRotateClockwise(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotate180") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Rotating I%d by 180º\n", n-1);
+      ImageRotate180(img[n-1]);
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
@@ -168,6 +488,16 @@ int main(int ac, char* av[]) {
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "view") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Viewing I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      img[n] = ImageView(img[n-1], x, y, w, h);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -187,6 +517,16 @@ int main(int ac, char* av[]) {
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
+    } else if (strcmp(av[k], "blendmask") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 3) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = ImageWidth(img[n-2]);
+      h = ImageHeight(img[n-2]);
+      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      if (ImageWidth(img[n-3]) != w || ImageHeight(img[n-3]) != h) { err = 5; break; }
+      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with mask I%d\n", n-2, n-1, x, y, n-3);
+      ImageBlendMask(img[n-1], x, y, img[n-2], img[n-3]);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
       fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
@@ -195,18 +535,108 @@ int main(int ac, char* av[]) {
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "match") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      double thr;
+      if (sscanf(av[k], "%lf", &thr) != 1) { err = 5; break; }
+      fprintf(stderr, "Matching I%d in I%d by normalized cross-correlation\n", n-2, n-1);
+      double score;
+      int found = ImageMatchNCC(img[n-1], img[n-2], &x, &y, &score);
+      if (found < 0) { err = 4; break; }
+      if (found && score >= thr) {
+        printf("# FOUND (%d,%d) %.6f\n", x, y, score);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      int max;
+      if (sscanf(av[k], "%d", &max) != 1 || max < 0) { err = 5; break; }
+      fprintf(stderr, "Locating up to %d occurrences of I%d in I%d\n", max, n-2, n-1);
+      int* xs = malloc((max > 0 ? max : 1) * sizeof(int));
+      int* ys = malloc((max > 0 ? max : 1) * sizeof(int));
+      int found = (xs != NULL && ys != NULL) ? ImageLocateAll(img[n-1], img[n-2], xs, ys, max) : -1;
+      for (int i = 0; i < found; i++) {
+        printf("# FOUND (%d,%d)\n", xs[i], ys[i]);
+      }
+      if (found == 0) printf("# NOTFOUND\n");
+      free(xs);
+      free(ys);
+      if (found < 0) { err = 4; break; }
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
       ImageBlur(img[n-1], dx, dy);
+    } else if (strcmp(av[k], "map") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Mapping %s -> I%d\n", av[k], n);
+      img[n] = ImageMap(av[k], IMAGE_MAP_PRIVATE);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
       if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "loadpbm") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Loading bitmap %s -> I%d\n", av[k], n);
+      Bitmap bmp = BitmapLoad(av[k]);
+      if (bmp == NULL) { err = 9; break; }
+      img[n] = ImageFromBitmap(bmp, PixMax);
+      BitmapDestroy(&bmp);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "savepbm") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Saving bitmap %s <- I%d\n", av[k], n-1);
+      Bitmap bmp = ImageToBitmap(img[n-1], (ImageMaxval(img[n-1]) + 1) / 2);
+      if (bmp == NULL) { err = 4; break; }
+      int saved = BitmapSave(bmp, av[k]);
+      BitmapDestroy(&bmp);
+      if (!saved) { err = 9; break; }
+    } else if (strcmp(av[k], "store") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int i = findNamed(av[k]);
+      if (i < 0 && nnamed >= MAXNAMED) { err = 11; break; }
+      fprintf(stderr, "Storing I%d as %s\n", n-1, av[k]);
+      // A copy: operations in place on CURR (or on fetched images) must
+      // not change the stored image
+      Image copy = ImageCrop(img[n-1], 0, 0, ImageWidth(img[n-1]), ImageHeight(img[n-1]));
+      if (copy == NULL) { err = 4; break; }
+      if (i >= 0) {
+        ImageDestroy(&named[i].img);
+      } else {
+        named[nnamed].name = strdup(av[k]);
+        if (named[nnamed].name == NULL) { ImageDestroy(&copy); err = 4; break; }
+        i = nnamed++;
+      }
+      named[i].img = copy;
+    } else if (strcmp(av[k], "fetch") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      int i = findNamed(av[k]);
+      if (i < 0) { err = 10; break; }
+      fprintf(stderr, "Fetching %s -> I%d\n", av[k], n);
+      img[n] = ImageCrop(named[i].img, 0, 0, ImageWidth(named[i].img), ImageHeight(named[i].img));
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "drop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int i = findNamed(av[k]);
+      if (i < 0) { err = 10; break; }
+      fprintf(stderr, "Dropping %s\n", av[k]);
+      dropNamed(i);
     } else {  // image file
       if (n >= N) { err = 3; break; }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
@@ -214,15 +644,277 @@ int main(int ac, char* av[]) {
       if (img[n] == NULL) { err = 4; break; }
       n++;
     }
+    endStage(av, k0, k, img, n, 0);
     k++;
   }
+  if (err != 0) {
+    endStage(av, k0, k < ac ? k : ac-1, img, n, 1);
+  }
+  if (pend.count > 0 && err == 0) {
+    flushPointOps(&pend, img[n-1]);
+  }
   
   // Destroy remaining images
   while (n > 0) {
     ImageDestroy(&img[--n]);
   }
+  return err;
+}
+
+// Report the result of a pipeline (as error() does), on stderr
+static void report(int err) {
+  error(0, errno, errors[err], err == 9 ? BitmapErrMsg() : ImageErrMsg());
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+
+// Server mode.  Each connection carries one request: the client sends its
+// stdout and stderr (as SCM_RIGHTS ancillary data) and a message with its
+// working directory and the arguments, each terminated by '\0'; then it
+// shuts down its side for writing.  The server runs the pipeline in that
+// directory, with that stdout and stderr, and answers with one byte: the
+// exit status (the index into errors[]).
+
+// Longest request accepted (bytes)
+#define MAXREQUEST (1 << 16)
+
+// Time a client has to send its request (seconds): requests are served
+// one at a time, so a client that never finishes would block all others
+#define REQUEST_TIMEOUT 10
+
+// Set by SIGINT and SIGTERM, to stop the server
+static volatile sig_atomic_t stopping = 0;
+
+static void stopServer(int sig) {
+  stopping = 1;
+}
+
+// Fill addr with the address of the socket at path.
+// Returns 0 if path is too long.
+static int socketAddress(struct sockaddr_un* addr, const char* path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+// Receive and run one request from connection fd.
+static void serveRequest(int fd, int home) {
+  static char buf[MAXREQUEST + 1];
+  int fds[2] = { -1, -1 };   // the client's stdout and stderr
+  union { struct cmsghdr h; char space[CMSG_SPACE(sizeof(fds))]; } control;
+  struct iovec iov = { .iov_base = buf, .iov_len = MAXREQUEST };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control.space, .msg_controllen = sizeof(control.space) };
+  ssize_t len = recvmsg(fd, &msg, 0);
+  if (len < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      error(0, 0, "Dropping request: not received within %d s", REQUEST_TIMEOUT);
+    return;
+  }
+  struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+      c->cmsg_len == CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+  }
+  // The rest of the message
+  size_t size = (size_t)len;
+  while (len > 0 && size < MAXREQUEST) {
+    len = read(fd, buf + size, MAXREQUEST - size);
+    if (len > 0) size += (size_t)len;
+  }
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    error(0, 0, "Dropping request: not received within %d s", REQUEST_TIMEOUT);
+  unsigned char status = 5;
+  if (fds[0] >= 0 && len == 0 && size > 0 && buf[size-1] == '\0') {
+    // Split the message into the directory and the arguments
+    int ac = 0;
+    for (size_t i = 0; i < size; i++) ac += (buf[i] == '\0');
+    char* av[ac + 1];
+    av[0] = program_name;
+    char* p = buf + strlen(buf) + 1;
+    for (int i = 1; i < ac; i++) {
+      av[i] = p;
+      p += strlen(p) + 1;
+    }
+    av[ac] = NULL;
+
+    // Run the pipeline as if started from the client
+    fflush(stdout);
+    fflush(stderr);
+    int out = dup(1), err = dup(2);
+    dup2(fds[0], 1);
+    dup2(fds[1], 2);
+    errno = 0;
+    if (chdir(buf) != 0) {
+      error(0, errno, "Changing to directory %s", buf);
+    } else if (ac <= 1) {
+      error(0, 0, "\n%s", USAGE);
+    } else {
+      status = (unsigned char)runPipeline(ac, av);
+      report(status);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    dup2(out, 1);
+    dup2(err, 2);
+    close(out);
+    close(err);
+    if (fchdir(home) != 0) error(2, errno, "Returning to server directory");
+  }
+  if (fds[0] >= 0) close(fds[0]);
+  if (fds[1] >= 0) close(fds[1]);
+  if (write(fd, &status, 1) != 1) {
+    // The client went away: nothing to do
+  }
+}
+
+// Nonzero if the peer of connection fd runs as the same user as this
+// process (only that user may run pipelines, with this process's rights).
+static int peerIsOwner(int fd) {
+#if defined(__linux__)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+// Serve pipelines on the Unix domain socket at path, until interrupted.
+// Calibration, named images and settings (threads, pool, ...) persist
+// between requests; requests are run one at a time.
+static void serve(const char* path) {
+  struct sockaddr_un addr;
+  if (!socketAddress(&addr, path)) error(2, errno, "Socket %s", path);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) error(2, errno, "Creating socket");
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);   // left by a previous server
+  }
+  mode_t mask = umask(077);   // a socket only its owner may connect to
+  if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) error(2, errno, "Binding %s", path);
+  umask(mask);
+  if (listen(s, 64) != 0) error(2, errno, "Listening on %s", path);
+  int home = open(".", O_RDONLY);
+  if (home < 0) error(2, errno, "Opening current directory");
+
+  struct sigaction sa = { .sa_handler = stopServer };   // no SA_RESTART: interrupt accept
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);   // clients may go away
+  fprintf(stderr, "Serving on %s\n", path);
+
+  while (!stopping) {
+    int fd = accept(s, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      error(2, errno, "Accepting connection");
+    }
+    if (!peerIsOwner(fd)) {
+      error(0, 0, "Rejecting connection from another user");
+      close(fd);
+      continue;
+    }
+    struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    serveRequest(fd, home);
+    close(fd);
+  }
 
-  error(err, errno, errors[err], ImageErrMsg());
-  return 0;
+  fprintf(stderr, "Stopping server on %s\n", path);
+  close(s);
+  unlink(path);
+  close(home);
+  while (nnamed > 0) dropNamed(nnamed - 1);
 }
 
+// Send the pipeline av[0], ..., av[ac-1] to the server at path and wait
+// for its completion.  Returns its status (an index into errors[]).
+static int connectServer(const char* path, int ac, char* av[]) {
+  struct sockaddr_un addr;
+  if (!socketAddress(&addr, path)) error(2, errno, "Socket %s", path);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) error(2, errno, "Creating socket");
+  if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) error(2, errno, "Connecting to %s", path);
+
+  // The message: working directory and arguments
+  static char buf[MAXREQUEST];
+  if (getcwd(buf, sizeof(buf)) == NULL) error(2, errno, "Getting current directory");
+  size_t size = strlen(buf) + 1;
+  for (int i = 0; i < ac; i++) {
+    size_t len = strlen(av[i]) + 1;
+    if (size + len > sizeof(buf)) error(5, 0, "Pipeline too long");
+    memcpy(buf + size, av[i], len);
+    size += len;
+  }
+
+  int fds[2] = { 1, 2 };
+  union { struct cmsghdr h; char space[CMSG_SPACE(sizeof(fds))]; } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { .iov_base = buf, .iov_len = size };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control.space, .msg_controllen = sizeof(control.space) };
+  struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+  fflush(stdout);
+  fflush(stderr);
+  ssize_t sent = sendmsg(s, &msg, 0);
+  if (sent < 0) error(2, errno, "Sending to %s", path);
+  while ((size_t)sent < size) {
+    ssize_t len = write(s, buf + sent, size - (size_t)sent);
+    if (len < 0) error(2, errno, "Sending to %s", path);
+    sent += len;
+  }
+  shutdown(s, SHUT_WR);
+
+  unsigned char status;
+  ssize_t len;
+  while ((len = read(s, &status, 1)) < 0 && errno == EINTR) ;
+  if (len != 1) error(2, len < 0 ? errno : 0, "No answer from %s", path);
+  close(s);
+  return status;
+}
+
+#endif
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  if (strcmp(av[1], "--serve") == 0 || strcmp(av[1], "--connect") == 0) {
+#if defined(__linux__) || defined(__APPLE__)
+    if (ac <= 2) error(5, 0, "\n%s", USAGE);
+    if (strcmp(av[1], "--connect") == 0) {
+      // The server reports errors on our stderr: just exit with its status
+      return connectServer(av[2], ac-3, av+3);
+    }
+    if (ac != 3) error(5, 0, "\n%s", USAGE);
+    ImageInit();
+    serve(av[2]);
+    return 0;
+#else
+    error(5, 0, "Server mode not supported on this system");
+#endif
+  }
+
+  ImageInit();
+  int err = runPipeline(ac, av);
+  while (nnamed > 0) dropNamed(nnamed - 1);
+  report(err);
+  return err;
+}
@@ -4,35 +4,36 @@
 /// Code for cpu_time() by
 /// Tomás Oliveira e Silva, AED, October 2021
 ///
-/// Use as follows:
+/// See instrumentation.h for usage.
 ///
-/// // Name the counters you're going to use: 
-/// InstrName[0] = "memops";
-/// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
-/// ...
-/// InstrReset();  // reset to zero
-/// for (...) {
-///   InstrCount[0] += 3;  // to count array acesses
-///   InstrCount[1] += 1;  // to count addition
-///   a[k] = a[i] + a[j];
-/// }
-/// InstrPrint();  // to show time and counters
+/// Each thread keeps its counters and the totals of its regions in its
+/// own record (struct instrthread), so counting and timing need no
+/// locking.  The records of all threads are kept in a list (and never
+/// freed), and InstrPrint merges them.  Likewise, each thread records
+/// its trace events in its own buffer, and InstrTraceClose writes them all.
 
 #include "instrumentation.h"
+#include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock time in seconds (from an arbitrary origin)
+double wall_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
 // GNU/Linux and MacOS code to measure elapsed time
 //
 
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 double cpu_time(void) {
   struct timespec current_time;
@@ -42,6 +43,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,10 +75,202 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // cpu_time() already measures elapsed time here
+}
+
+#endif
+
+
+// Hardware event counters
+
+// Names of the events
+static const char* eventName[NUMEVENTS] = {
+  "cycles", "instructions", "cache-misses", "branch-misses", "page-faults"
+};
+
+// Event values read on previous reset
+static unsigned long long eventBase[NUMEVENTS];
+
+// Number of events counted
+static int numEvents = 0;
+
+#if defined(__linux__)
+
+//
+// GNU/Linux code to count events (see man 2 perf_event_open)
+//
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// File descriptor of each event counter (-1: not counted)
+static int eventFd[NUMEVENTS] = {-1, -1, -1, -1, -1};
+
+/// Start counting hardware events and page faults of the process.
+int InstrEventsOpen(void) { ///
+  static const struct { unsigned type; unsigned long long config; } event[NUMEVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+  };
+  int errsave = errno;
+  for (int i = 0; i < NUMEVENTS; i++) {
+    if (eventFd[i] >= 0) continue;
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event[i].type;
+    attr.config = event[i].config;
+    attr.inherit = 1;         // count threads created later too
+    attr.exclude_kernel = event[i].type == PERF_TYPE_HARDWARE;  // usually not allowed
+    attr.exclude_hv = 1;
+    eventFd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (eventFd[i] >= 0) numEvents++;
+  }
+  errno = errsave;
+  return numEvents;
+}
+
+// Read the events into value (0 for events not counted)
+static void readEvents(unsigned long long value[NUMEVENTS]) {
+  int errsave = errno;
+  for (int i = 0; i < NUMEVENTS; i++) {
+    value[i] = 0;
+    if (eventFd[i] >= 0 && read(eventFd[i], &value[i], sizeof(value[i])) != sizeof(value[i]))
+      value[i] = 0;
+  }
+  errno = errsave;
+}
+
+// Is event i counted?
+static int eventCounted(int i) {
+  return eventFd[i] >= 0;
+}
+
+#else
+
+int InstrEventsOpen(void) { ///
+  return 0;
+}
+
+static void readEvents(unsigned long long value[NUMEVENTS]) {
+  for (int i = 0; i < NUMEVENTS; i++) value[i] = 0;
+}
+
+static int eventCounted(int i) {
+  (void)i;
+  return 0;
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+// Maximum number of distinct regions per thread
+#define MAXREGIONS 256
+// Maximum nesting depth of timed regions (deeper regions are not timed)
+#define MAXDEPTH 32
+
+// Totals of a region
+struct region {
+  const char* name;
+  int parent;                         // enclosing region (-1: none)
+  unsigned long calls;
+  double wall, cpu;                   // total times
+  unsigned long count[NUMCOUNTERS];   // total changes of the counters
+  unsigned long long event[NUMEVENTS];  // total events
+  unsigned long long bytes[INSTR_KERNELS];  // total bytes moved by kernels
+};
+
+// A region being timed
+struct active {
+  int region;                         // index of its totals (-1: none)
+  double wall, cpu;                   // times at the start
+  unsigned long count[NUMCOUNTERS];   // counters at the start
+  unsigned long long event[NUMEVENTS];  // events at the start
+};
+
+// A recorded region or span (trace event)
+struct traceevent {
+  char name[48];
+  char detail[96];                    // ("": none)
+  int span;                           // nonzero for spans, zero for regions
+  double start, end;                  // wall times
+  unsigned long count[NUMCOUNTERS];   // changes of the counters
+  unsigned long long event[NUMEVENTS];  // events (regions only)
+};
+
+// A span being timed
+struct activespan {
+  int all;                            // counts of all threads (or its own)?
+  double wall;                        // time at the start
+  unsigned long count[NUMCOUNTERS];   // counters at the start
+};
+
+// Instrumentation data of a thread
+struct instrthread {
+  unsigned long count[NUMCOUNTERS];
+  unsigned long long bytes[INSTR_KERNELS];  // moved by kernels
+  struct region region[MAXREGIONS];
+  int nregions;
+  struct active stack[MAXDEPTH];
+  int depth;                          // number of regions begun and not ended
+  int id;                             // number of the thread (in the trace)
+  struct traceevent* trace;           // recorded trace events
+  int ntrace, maxtrace;               // their number, and room
+  struct activespan spans[MAXDEPTH];
+  int nspans;                         // number of spans begun and not ended
+  struct instrthread* next;           // next in the list of all threads
+};
+
+// Shared by threads whose record cannot be allocated (and always listed)
+static struct instrthread spare;
+
+// List of the records of all threads
+static struct instrthread* threads = &spare;
+
+// Record of the calling thread
+static __thread struct instrthread* self;
+
+// Number of records created
+static int numThreads = 0;
+
+/// Counters of the calling thread (NULL until first used)
+__thread unsigned long* InstrThreadCount = NULL;  ///extern
+
+/// Create the counters of the calling thread.  (Used by InstrCount.)
+unsigned long* InstrThreadInit(void) { ///
+  if (self == NULL) {
+    struct instrthread* t = calloc(1, sizeof(struct instrthread));
+    if (t == NULL) {
+      self = &spare;
+    } else {
+      t->id = __atomic_add_fetch(&numThreads, 1, __ATOMIC_RELAXED);
+      t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&threads, &t->next, t, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+      self = t;
+    }
+    InstrThreadCount = self->count;
+  }
+  return InstrThreadCount;
+}
+
+// Record of the calling thread, created if needed
+static struct instrthread* thread(void) {
+  if (self == NULL) InstrThreadInit();
+  return self;
+}
+
+/// Sum the counters of all threads into count.
+void InstrSum(unsigned long count[NUMCOUNTERS]) { ///
+  for (int i = 0; i < NUMCOUNTERS; i++) count[i] = 0ul;
+  for (struct instrthread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+    for (int i = 0; i < NUMCOUNTERS; i++) count[i] += t->count[i];
+  }
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -79,51 +280,695 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
+/// Wall_time read on previous reset (~seconds)
+double InstrWall;  ///extern
+
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
+/// Output format of InstrPrint (initially INSTR_TEXT)
+int InstrFormat = INSTR_TEXT;  ///extern
+
+/// Bandwidth of each kernel (bytes read and written per second)
+double InstrBandwidth[INSTR_KERNELS];  ///extern
+
+// Names of the kernels
+static const char* kernelName[INSTR_KERNELS] = { "memcpy", "lut", "transpose" };
+
+// Nonzero after InstrCalibrate
+static int calibrated = 0;
+
+// Calibration cache
+
+// Version of the calibration (results of other versions are not used)
+#define CALIBRATION_VERSION 1
+
+// Describe this machine as "CPU model\tfrequency governor" in key
+static void machineKey(char* key, size_t size) {
+  char model[256] = "unknown";
+  char governor[64] = "none";
+#if defined(__linux__)
+  char line[512];
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      char* colon = strchr(line, ':');
+      if (colon != NULL && strncmp(line, "model name", 10) == 0) {
+        snprintf(model, sizeof(model), "%s", colon + 1 + (colon[1] == ' '));
+        break;
+      }
+    }
+    fclose(f);
+  }
+  f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", "r");
+  if (f != NULL) {
+    if (fgets(governor, sizeof(governor), f) == NULL) strcpy(governor, "none");
+    fclose(f);
+  }
+  model[strcspn(model, "\t\n")] = '\0';
+  governor[strcspn(governor, "\t\n")] = '\0';
+#endif
+  snprintf(key, size, "%s\t%s", model, governor);
+}
+
+// Name of the cache file in buf (NULL if there is none)
+static const char* cacheFile(char* buf, size_t size) {
+  const char* env = getenv("INSTR_CACHE");
+  if (env != NULL) return env[0] != '\0' ? env : NULL;
+  const char* dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0') {
+    snprintf(buf, size, "%s/instrumentation", dir);
+  } else {
+    const char* home = getenv("HOME");
+    if (home == NULL || home[0] == '\0') return NULL;
+    snprintf(buf, size, "%s/.cache/instrumentation", home);
+  }
+  return buf;
+}
+
+// Read the results for key from the cache file.
+// Returns nonzero if found.
+static int readCache(const char* file, const char* key) {
+  FILE* f = fopen(file, "r");
+  if (f == NULL) return 0;
+  char line[1024];
+  size_t len = strlen(key);
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    int version, n = 0;
+    if (sscanf(line, "%d\t%n", &version, &n) == 1 && version == CALIBRATION_VERSION &&
+        strncmp(line + n, key, len) == 0 && line[n + len] == '\t') {
+      double v[1 + INSTR_KERNELS];
+      found = sscanf(line + n + len, "%lf %lf %lf %lf", &v[0], &v[1], &v[2], &v[3]) == 1 + INSTR_KERNELS &&
+              v[0] > 0.0 && v[1] > 0.0 && v[2] > 0.0 && v[3] > 0.0;
+      if (found) {
+        InstrCTU = v[0];
+        for (int k = 0; k < INSTR_KERNELS; k++) InstrBandwidth[k] = v[1 + k];
+      }
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+// Write the results for key to the cache file, keeping those of other
+// machines.  (The file is replaced at once, so that concurrent readers
+// see either version.)
+static void writeCache(const char* file, const char* key) {
+  char tmp[4096 + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%ld", file, (long)getpid());
+#if defined(__linux__) || defined(__APPLE__)
+  // Create the directory (only the last level), if needed
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s", file);
+  char* slash = strrchr(dir, '/');
+  if (slash != NULL && slash != dir) {
+    *slash = '\0';
+    mkdir(dir, 0700);
+  }
+#endif
+  FILE* out = fopen(tmp, "w");
+  if (out == NULL) return;
+  FILE* in = fopen(file, "r");
+  char line[1024];
+  size_t len = strlen(key);
+  while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+    int version, n = 0;
+    if (!(sscanf(line, "%d\t%n", &version, &n) == 1 && version == CALIBRATION_VERSION &&
+          strncmp(line + n, key, len) == 0 && line[n + len] == '\t'))
+      fputs(line, out);
+  }
+  if (in != NULL) fclose(in);
+  fprintf(out, "%d\t%s\t%.9g", CALIBRATION_VERSION, key, InstrCTU);
+  for (int k = 0; k < INSTR_KERNELS; k++) fprintf(out, "\t%.6g", InstrBandwidth[k]);
+  fprintf(out, "\n");
+  if (fclose(out) != 0 || rename(tmp, file) != 0) remove(tmp);
+}
+
+// Bandwidth profile
+
+// The kernels are plain C, run by one thread: a reference of what simple
+// code achieves on this machine (vector kernels and threads do better).
+
+// Size of the buffers of the kernels (bytes): larger than most caches
+#define PROFILE_BYTES (32 << 20)
+// Size of the matrix transposed (not powers of 2, whose columns would
+// compete for the same cache sets), and side of its tiles
+#define PROFILE_ROWS 4000
+#define PROFILE_COLS 8000
+#define PROFILE_TILE 16
+
+// Run kernel k once, from src to dst.
+// Returns the number of bytes read and written.
+static double runKernel(int k, unsigned char* dst, const unsigned char* src, const unsigned char lut[256]) {
+  switch (k) {
+  case INSTR_MEMCPY:
+    memcpy(dst, src, PROFILE_BYTES);
+    break;
+  case INSTR_LUT:
+    for (size_t i = 0; i < PROFILE_BYTES; i++) dst[i] = lut[src[i]];
+    break;
+  case INSTR_TRANSPOSE:  // src is PROFILE_ROWS x PROFILE_COLS
+    for (size_t i0 = 0; i0 < PROFILE_ROWS; i0 += PROFILE_TILE)
+      for (size_t j0 = 0; j0 < PROFILE_COLS; j0 += PROFILE_TILE)
+        for (size_t i = i0; i < i0 + PROFILE_TILE; i++)
+          for (size_t j = j0; j < j0 + PROFILE_TILE; j++)
+            dst[j * PROFILE_ROWS + i] = src[i * PROFILE_COLS + j];
+    return 2.0 * PROFILE_ROWS * PROFILE_COLS;
+  }
+  return 2.0 * PROFILE_BYTES;
+}
+
+// Measure the bandwidth of each kernel: the best of a few runs
+// (0 if there is no memory for the buffers).
+static void profileKernels(void) {
+  unsigned char* src = malloc(PROFILE_BYTES);
+  unsigned char* dst = malloc(PROFILE_BYTES);
+  if (src != NULL && dst != NULL) {
+    unsigned char lut[256];
+    for (int i = 0; i < 256; i++) lut[i] = (unsigned char)(255 - i);
+    for (size_t i = 0; i < PROFILE_BYTES; i++) src[i] = (unsigned char)(i * 7 + (i >> 12));
+    memset(dst, 0, PROFILE_BYTES);
+    static volatile unsigned char sink;  // so that no kernel is optimized away
+    for (int k = 0; k < INSTR_KERNELS; k++) {
+      double best = 0.0, bytes = 0.0;
+      for (int run = 0; run < 3; run++) {
+        double time = wall_time();
+        bytes = runKernel(k, dst, src, lut);
+        time = wall_time() - time;
+        sink ^= dst[(size_t)run * 4099];
+        if (time > 0.0 && (best == 0.0 || time < best)) best = time;
+      }
+      InstrBandwidth[k] = best > 0.0 ? bytes / best : 0.0;
+    }
+  }
+  free(src);
+  free(dst);
+}
+
+/// Find the Calibrated Time Unit (CTU) and the bandwidth of the kernels.
 /// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
+/// a reasonably cpu-independent time unit, and time each kernel.
+/// The results are kept in a cache file, for each machine.
 void InstrCalibrate(void) { ///
-  const int size = 4*1024;     // 2^12!
-  const int mask = size - 1;
-  int array[size];  // alloc array in stack, not initialized on purpose
-  double time = cpu_time();
-  srand((unsigned int)(time*1e9));
-  for (int n = 0; n < 40000000; n++) {
-    int i = rand() & mask;
-    int j = rand() & mask;
-    int k = rand() & mask;
-    array[k] ^= array[i] + array[j] + i*j;
-    //printf("%d %d %d\n", i, j, k);  // debug
-  }
-  InstrCTU = cpu_time() - time;
-}
-
-/// Reset counters to zero and store cpu_time.
+  if (calibrated) return;
+  calibrated = 1;
+  int errsave = errno;
+  char key[512], buf[4096];
+  machineKey(key, sizeof(key));
+  const char* file = cacheFile(buf, sizeof(buf));
+  if (file == NULL || !readCache(file, key)) {
+    const int size = 4*1024;     // 2^12!
+    const int mask = size - 1;
+    int array[size];  // alloc array in stack, not initialized on purpose
+    double time = cpu_time();
+    srand((unsigned int)(time*1e9));
+    for (int n = 0; n < 40000000; n++) {
+      int i = rand() & mask;
+      int j = rand() & mask;
+      int k = rand() & mask;
+      array[k] ^= array[i] + array[j] + i*j;
+      //printf("%d %d %d\n", i, j, k);  // debug
+    }
+    InstrCTU = cpu_time() - time;
+    profileKernels();
+    if (file != NULL && InstrBandwidth[0] > 0.0) writeCache(file, key);
+  }
+  errno = errsave;
+}
+
+/// Reset counters and regions to zero and store cpu_time and wall_time.
 void InstrReset(void) { ///
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+  for (struct instrthread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      t->count[i] = 0ul;
+    memset(t->bytes, 0, sizeof(t->bytes));
+    for (int r = 0; r < t->nregions; r++) {
+      t->region[r].calls = 0ul;
+      t->region[r].wall = t->region[r].cpu = 0.0;
+      memset(t->region[r].count, 0, sizeof(t->region[r].count));
+      memset(t->region[r].event, 0, sizeof(t->region[r].event));
+      memset(t->region[r].bytes, 0, sizeof(t->region[r].bytes));
+    }
+    // Regions and spans being timed count from now on
+    for (int d = 0; d < t->depth && d < MAXDEPTH; d++)
+      memset(t->stack[d].count, 0, sizeof(t->stack[d].count));
+    for (int d = 0; d < t->nspans && d < MAXDEPTH; d++)
+      memset(t->spans[d].count, 0, sizeof(t->spans[d].count));
+  }
+  readEvents(eventBase);
   InstrTime = cpu_time();
+  InstrWall = wall_time();
 }
 
-// Print times and all named counter values
+// Trace
+
+/// Nonzero while a trace is recorded
+int InstrTracing = 0;  ///extern
+
+// File the trace is written to
+static FILE* traceFile = NULL;
+// Wall time at the start of the trace
+static double traceStart;
+// Thread that started the trace
+static struct instrthread* traceOwner;
+
+// Add an event named name (with detail, if not NULL) from start to end to
+// the trace of thread t, with zero counts.
+// Returns it, or NULL if there is no memory for it (it is then lost).
+static struct traceevent* traceEvent(struct instrthread* t, const char* name, const char* detail,
+                                     double start, double end) {
+  if (t->ntrace == t->maxtrace) {
+    int max = t->maxtrace > 0 ? 2 * t->maxtrace : 256;
+    struct traceevent* trace = realloc(t->trace, max * sizeof(struct traceevent));
+    if (trace == NULL) return NULL;
+    t->trace = trace;
+    t->maxtrace = max;
+  }
+  struct traceevent* e = &t->trace[t->ntrace++];
+  memset(e, 0, sizeof(struct traceevent));
+  snprintf(e->name, sizeof(e->name), "%s", name);
+  snprintf(e->detail, sizeof(e->detail), "%s", detail != NULL ? detail : "");
+  e->start = start;
+  e->end = end;
+  return e;
+}
+
+/// Start recording a trace, to be written to filename.
+int InstrTraceOpen(const char* filename) { ///
+  if (traceFile != NULL) fclose(traceFile);
+  traceFile = fopen(filename, "w");
+  InstrTracing = traceFile != NULL;
+  if (traceFile == NULL) return 0;
+  for (struct instrthread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+    t->ntrace = 0;
+  traceOwner = thread();
+  traceStart = wall_time();
+  return 1;
+}
+
+/// Start a span of the calling thread (if a trace is recorded).
+void InstrSpanBegin(int all) { ///
+  if (!InstrTracing) return;
+  struct instrthread* t = thread();
+  if (t->nspans < MAXDEPTH) {
+    struct activespan* s = &t->spans[t->nspans];
+    s->all = all;
+    if (all) InstrSum(s->count);
+    else memcpy(s->count, t->count, sizeof(s->count));
+    s->wall = wall_time();
+  }
+  t->nspans++;
+}
+
+/// End the current span of the calling thread, and record it.
+void InstrSpanEnd(const char* name, const char* detail) { ///
+  struct instrthread* t = thread();
+  if (t->nspans == 0) return;  // begun before the trace
+  t->nspans--;
+  if (InstrTracing && t->nspans < MAXDEPTH) {
+    struct activespan* s = &t->spans[t->nspans];
+    struct traceevent* e = traceEvent(t, name, detail, s->wall, wall_time());
+    if (e != NULL) {
+      unsigned long count[NUMCOUNTERS];
+      if (s->all) InstrSum(count);
+      else memcpy(count, t->count, sizeof(count));
+      e->span = 1;
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        e->count[i] = count[i] - s->count[i];
+    }
+  }
+}
+
+// Write s as a JSON string to f
+static void writeString(FILE* f, const char* s) {
+  fputc('"', f);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+    else fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+/// Stop recording the trace and write it.
+int InstrTraceClose(void) { ///
+  if (traceFile == NULL) return 1;
+  FILE* f = traceFile;
+  traceFile = NULL;
+  InstrTracing = 0;
+  // Complete events ("X"), with times in microseconds, and the names of
+  // the threads as metadata events ("M")
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  int first = 1;
+  for (struct instrthread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+    if (t->ntrace == 0 && t != traceOwner) continue;
+    char name[32];
+    if (t == traceOwner) snprintf(name, sizeof(name), "main");
+    else snprintf(name, sizeof(name), "thread %d", t->id);
+    fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            first ? "" : ",", t->id, name);
+    first = 0;
+    for (int k = 0; k < t->ntrace; k++) {
+      struct traceevent* e = &t->trace[k];
+      fprintf(f, ",\n{\"name\": ");
+      writeString(f, e->name);
+      fprintf(f, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {",
+              e->span ? "span" : "region", 1e6 * (e->start - traceStart), 1e6 * (e->end - e->start), t->id);
+      int comma = 0;
+      if (e->detail[0] != '\0') {
+        fprintf(f, "\"detail\": ");
+        writeString(f, e->detail);
+        comma = 1;
+      }
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        if (InstrName[i] != NULL) {
+          fprintf(f, "%s", comma ? ", " : "");
+          writeString(f, InstrName[i]);
+          fprintf(f, ": %lu", e->count[i]);
+          comma = 1;
+        }
+      for (int i = 0; i < NUMEVENTS && !e->span; i++)
+        if (eventCounted(i)) {
+          fprintf(f, "%s\"%s\": %llu", comma ? ", " : "", eventName[i], e->event[i]);
+          comma = 1;
+        }
+      fprintf(f, "}}");
+    }
+    t->ntrace = 0;
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+
+/// Start a region named name, inside the current region of the calling thread.
+void InstrBegin(const char* name) { ///
+  struct instrthread* t = thread();
+  if (t->depth < MAXDEPTH) {
+    int parent = t->depth > 0 ? t->stack[t->depth - 1].region : -1;
+    // Find the totals of the region (name inside parent), or add them
+    int r = 0;
+    while (r < t->nregions && !(t->region[r].parent == parent &&
+           (t->region[r].name == name || strcmp(t->region[r].name, name) == 0)))
+      r++;
+    if (r == t->nregions) {
+      if (r < MAXREGIONS) {
+        memset(&t->region[r], 0, sizeof(struct region));
+        t->region[r].name = name;
+        t->region[r].parent = parent;
+        t->nregions++;
+      } else {
+        r = -1;  // too many regions: not timed
+      }
+    }
+    struct active* a = &t->stack[t->depth];
+    a->region = r;
+    if (numEvents > 0) readEvents(a->event);
+    InstrSum(a->count);
+    a->cpu = cpu_time();
+    a->wall = wall_time();
+  }
+  t->depth++;
+}
+
+/// End the current region of the calling thread.
+void InstrEnd(void) { ///
+  struct instrthread* t = thread();
+  assert (t->depth > 0);
+  t->depth--;
+  if (t->depth < MAXDEPTH && t->stack[t->depth].region >= 0) {
+    double wall = wall_time();
+    double cpu = cpu_time();
+    unsigned long count[NUMCOUNTERS];
+    InstrSum(count);
+    unsigned long long event[NUMEVENTS];
+    if (numEvents > 0) readEvents(event);
+    struct active* a = &t->stack[t->depth];
+    struct region* r = &t->region[a->region];
+    r->calls++;
+    r->wall += wall - a->wall;
+    r->cpu += cpu - a->cpu;
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      r->count[i] += count[i] - a->count[i];
+    for (int i = 0; i < NUMEVENTS && numEvents > 0; i++)
+      r->event[i] += event[i] - a->event[i];
+    if (InstrTracing) {
+      struct traceevent* e = traceEvent(t, r->name, NULL, a->wall, wall);
+      if (e != NULL) {
+        for (int i = 0; i < NUMCOUNTERS; i++)
+          e->count[i] = count[i] - a->count[i];
+        for (int i = 0; i < NUMEVENTS && numEvents > 0; i++)
+          e->event[i] = event[i] - a->event[i];
+      }
+    }
+  }
+}
+
+/// Declare bytes moved by the calling thread with a kernel like kernel.
+void InstrKernel(int kernel, unsigned long long bytes) { ///
+  assert (0 <= kernel && kernel < INSTR_KERNELS);
+  struct instrthread* t = thread();
+  t->bytes[kernel] += bytes;
+  for (int d = 0; d < t->depth && d < MAXDEPTH; d++)
+    if (t->stack[d].region >= 0)
+      t->region[t->stack[d].region].bytes[kernel] += bytes;
+}
+
+// Merge the regions of all threads (same name and same enclosing regions).
+// Returns an array of regions (parents before children), and its length in *n.
+static struct region* mergeRegions(int* n) {
+  int total = 0;
+  for (struct instrthread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+    total += t->nregions;
+  struct region* all = malloc((total > 0 ? total : 1) * sizeof(struct region));
+  int map[MAXREGIONS];  // index in all of each region of a thread
+  *n = 0;
+  if (all == NULL) return NULL;
+  for (struct instrthread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+    for (int r = 0; r < t->nregions; r++) {
+      struct region* src = &t->region[r];
+      int parent = src->parent >= 0 ? map[src->parent] : -1;
+      int m = 0;
+      while (m < *n && !(all[m].parent == parent && strcmp(all[m].name, src->name) == 0))
+        m++;
+      if (m == *n) {
+        memset(&all[m], 0, sizeof(struct region));
+        all[m].name = src->name;
+        all[m].parent = parent;
+        (*n)++;
+      }
+      all[m].calls += src->calls;
+      all[m].wall += src->wall;
+      all[m].cpu += src->cpu;
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        all[m].count[i] += src->count[i];
+      for (int i = 0; i < NUMEVENTS; i++)
+        all[m].event[i] += src->event[i];
+      for (int k = 0; k < INSTR_KERNELS; k++)
+        all[m].bytes[k] += src->bytes[k];
+      map[r] = m;
+    }
+  }
+  return all;
+}
+
+// Path of region r: names of the enclosing regions and its own, separated by '/'
+static void regionPath(struct region* all, int r, char* buf, size_t size) {
+  if (all[r].parent >= 0) {
+    regionPath(all, all[r].parent, buf, size);
+    size_t len = strlen(buf);
+    snprintf(buf + len, size - len, "/%s", all[r].name);
+  } else {
+    snprintf(buf, size, "%s", all[r].name);
+  }
+}
+
+// Nonzero if InstrPrint shows efficiencies (kernels were declared)
+static int showEfficiency = 0;
+
+// Efficiency of a region that moved bytes in wall seconds: the time its
+// kernels take at the calibrated bandwidths, over wall (-1 if unknown)
+static double efficiency(const unsigned long long bytes[INSTR_KERNELS], double wall) {
+  double ideal = 0.0;
+  for (int k = 0; k < INSTR_KERNELS; k++)
+    if (InstrBandwidth[k] > 0.0)
+      ideal += (double)bytes[k] / InstrBandwidth[k];
+  return ideal > 0.0 && wall > 0.0 ? ideal / wall : -1.0;
+}
+
+// Print the names of the named counters and of the events counted,
+// each preceded by sep (text and CSV)
+static void printNames(const char* sep) {
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      printf(InstrFormat == INSTR_CSV ? "%s%s" : "%s%15.15s", sep, InstrName[i]);
+  for (int i = 0; i < NUMEVENTS; i++)
+    if (eventCounted(i))
+      printf(InstrFormat == INSTR_CSV ? "%s%s" : "%s%15.15s", sep, eventName[i]);
+  if (showEfficiency)
+    printf(InstrFormat == INSTR_CSV ? "%s%s" : "%s%15.15s", sep, "efficiency");
+}
+
+// Print the values of the named counters and of the events counted,
+// and the efficiency eff (see efficiency)
+static void printValues(const unsigned long count[NUMCOUNTERS], const unsigned long long event[NUMEVENTS], double eff) {
+  switch (InstrFormat) {
+  case INSTR_CSV:
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        printf(",%lu", count[i]);
+    for (int i = 0; i < NUMEVENTS; i++)
+      if (eventCounted(i))
+        printf(",%llu", event[i]);
+    if (showEfficiency) {
+      if (eff >= 0.0) printf(",%.4f", eff);
+      else printf(",");
+    }
+    break;
+  case INSTR_JSON:
+    printf("\"counters\": {");
+    for (int i = 0, first = 1; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL) {
+        printf("%s\"%s\": %lu", first ? "" : ", ", InstrName[i], count[i]);
+        first = 0;
+      }
+    printf("}");
+    if (numEvents > 0) {
+      printf(", \"events\": {");
+      for (int i = 0, first = 1; i < NUMEVENTS; i++)
+        if (eventCounted(i)) {
+          printf("%s\"%s\": %llu", first ? "" : ", ", eventName[i], event[i]);
+          first = 0;
+        }
+      printf("}");
+    }
+    if (showEfficiency && eff >= 0.0)
+      printf(", \"efficiency\": %.4f", eff);
+    break;
+  default:
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        printf("\t%15lu", count[i]);
+    for (int i = 0; i < NUMEVENTS; i++)
+      if (eventCounted(i))
+        printf("\t%15llu", event[i]);
+    if (showEfficiency) {
+      if (eff >= 0.0) printf("\t%14.1f%%", 100.0 * eff);
+      else printf("\t%15s", "");
+    }
+  }
+}
+
+// Print the regions inside region parent (and theirs), depth levels deep.
+// (*first is nonzero until the first region is printed.)
+static void printRegions(struct region* all, int n, int parent, int depth, int* first) {
+  char path[1024];
+  for (int r = 0; r < n; r++) {
+    if (all[r].parent != parent || all[r].calls == 0) continue;
+    switch (InstrFormat) {
+    case INSTR_CSV:
+      regionPath(all, r, path, sizeof(path));
+      printf("\"%s\",%d,%lu,%.9f,%.9f,%.9f", path, depth, all[r].calls, all[r].wall, all[r].cpu, all[r].cpu / InstrCTU);
+      printValues(all[r].count, all[r].event, efficiency(all[r].bytes, all[r].wall));
+      puts("");
+      break;
+    case INSTR_JSON:
+      regionPath(all, r, path, sizeof(path));
+      printf("%s\n    {\"path\": \"%s\", \"name\": \"%s\", \"depth\": %d, \"calls\": %lu, "
+             "\"wall\": %.9f, \"time\": %.9f, \"caltime\": %.9f, ",
+             *first ? "" : ",", path, all[r].name, depth, all[r].calls, all[r].wall, all[r].cpu, all[r].cpu / InstrCTU);
+      printValues(all[r].count, all[r].event, efficiency(all[r].bytes, all[r].wall));
+      printf("}");
+      break;
+    default:
+      printf("%*s%-*.*s\t%15lu\t%15.6f\t%15.6f", 2 * depth, "", 30 - 2 * depth, 30 - 2 * depth, all[r].name,
+             all[r].calls, all[r].wall, all[r].cpu);
+      printValues(all[r].count, all[r].event, efficiency(all[r].bytes, all[r].wall));
+      puts("");
+    }
+    *first = 0;
+    printRegions(all, n, r, depth + 1, first);
+  }
+}
+
+/// Print times and all named counter values since the last reset,
+/// followed by the totals of each region, in the format InstrFormat.
 void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  double wall = wall_time() - InstrWall;
+  unsigned long count[NUMCOUNTERS];
+  InstrSum(count);
+  unsigned long long event[NUMEVENTS];
+  readEvents(event);
+  for (int i = 0; i < NUMEVENTS; i++)
+    event[i] -= eventBase[i];
+  unsigned long long bytes[INSTR_KERNELS] = {0};
+  for (struct instrthread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+    for (int k = 0; k < INSTR_KERNELS; k++)
+      bytes[k] += t->bytes[k];
+  if (!calibrated) {
+    // Calibrate now, leaving its times and events out of this report
+    // (read above) and of later ones (by moving the reset values)
+    unsigned long long before[NUMEVENTS], after[NUMEVENTS];
+    readEvents(before);
+    double cpu0 = cpu_time(), wall0 = wall_time();
+    InstrCalibrate();
+    InstrTime += cpu_time() - cpu0;
+    InstrWall += wall_time() - wall0;
+    readEvents(after);
+    for (int i = 0; i < NUMEVENTS; i++)
+      eventBase[i] += after[i] - before[i];
+  }
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
+  double eff = efficiency(bytes, wall);
+  showEfficiency = eff >= 0.0;
+  int n, first = 1;
+  struct region* all = mergeRegions(&n);
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    if (InstrName[i] != NULL)
-      printf("\t%15.15s", InstrName[i]);
-  puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
-  puts("");
+  switch (InstrFormat) {
+  case INSTR_CSV:
+    printf("region,depth,calls,wall,time,caltime");
+    printNames(",");
+    puts("");
+    printf("\"\",-1,1,%.9f,%.9f,%.9f", wall, time, caltime);
+    printValues(count, event, eff);
+    puts("");
+    printRegions(all, n, -1, 0, &first);
+    break;
+  case INSTR_JSON:
+    printf("{\"wall\": %.9f, \"time\": %.9f, \"caltime\": %.9f, ", wall, time, caltime);
+    printValues(count, event, eff);
+    if (showEfficiency) {
+      printf(",\n  \"bandwidth\": {");
+      for (int k = 0; k < INSTR_KERNELS; k++)
+        printf("%s\"%s\": %.6g", k > 0 ? ", " : "", kernelName[k], InstrBandwidth[k]);
+      printf("}");
+    }
+    printf(",\n  \"regions\": [");
+    printRegions(all, n, -1, 0, &first);
+    puts("\n  ]}");
+    break;
+  default:
+    printf("#%14.15s\t%15.15s\t%15.15s", "time", "caltime", "wall");
+    printNames("\t");
+    puts("");
+    printf("%15.6f\t%15.6f\t%15.6f", time, caltime, wall);
+    printValues(count, event, eff);
+    puts("");
+    if (showEfficiency) {
+      printf("# bandwidth (GB/s):");
+      for (int k = 0; k < INSTR_KERNELS; k++)
+        printf(" %s %.2f", kernelName[k], InstrBandwidth[k] / 1e9);
+      puts("");
+    }
+    if (n > 0) {
+      printf("#%-29s\t%15.15s\t%15.15s\t%15.15s", "region", "calls", "wall", "time");
+      printNames("\t");
+      puts("");
+      printRegions(all, n, -1, 0, &first);
+    }
+  }
+  free(all);
 }
-
@@ -6,18 +6,31 @@
 ///
 /// Use as follows:
 ///
-/// // Name the counters you're going to use: 
+/// // Name the counters you're going to use:
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // optional: InstrPrint calibrates when first needed
 /// ...
 /// InstrReset();  // reset to zero
+/// InstrBegin("loop");  // start a named region (optional)
 /// for (...) {
 ///   InstrCount[0] += 3;  // to count array acesses
 ///   InstrCount[1] += 1;  // to count addition
 ///   a[k] = a[i] + a[j];
 /// }
+/// InstrEnd();  // end the region
 /// InstrPrint();  // to show time and counters
+///
+/// Each thread has its own counters (so counting needs no atomic
+/// operations); InstrPrint shows their sums.
+/// Regions may be nested, and are timed both in wall-clock time and in
+/// CPU time (of all threads of the process).  Regions with the same name
+/// and the same enclosing regions are accumulated together.
+/// Hardware event counters may be added (see InstrEventsOpen).
+/// Code may also declare the bytes moved by its basic kernels (see
+/// InstrKernel), to have its efficiency shown by InstrPrint.
+/// A timeline of the regions of all threads may be recorded, for a trace
+/// viewer (see InstrTraceOpen).
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
@@ -25,11 +38,43 @@
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock time in seconds (from an arbitrary origin)
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Number of hardware (and kernel) event counters: cycles, instructions,
+/// cache-misses, branch-misses and page-faults
+#define NUMEVENTS 5
+
+/// Instrumentation level, chosen at compile time (-DINSTR_LEVEL=n) by
+/// code that counts operations (see InstrCounter):
+/// 0: off (counts compile to nothing),
+/// 1: coarse (bulk counts, added once per operation or band),
+/// 2: fine (also counts of single accesses; the default).
+#ifndef INSTR_LEVEL
+#define INSTR_LEVEL 2
+#endif
+
+/// Array of operation counters of the calling thread:
+/// InstrCount[i] may be used as an array of unsigned long.
+#define InstrCount (InstrThreadCount != NULL ? InstrThreadCount : InstrThreadInit())
+
+/// Counter i of the calling thread if INSTR_LEVEL >= level, or else a
+/// temporary (whose updates the compiler removes), as an lvalue:
+///   InstrCounter(1, 0) += n;  // bulk count, unless instrumentation is off
+#define InstrCounter(level, i) \
+  (*(INSTR_LEVEL >= (level) ? &InstrCount[i] : (unsigned long[1]){0}))
+
+/// Counters of the calling thread (NULL until first used)
+extern __thread unsigned long* InstrThreadCount;  ///extern
+
+/// Create the counters of the calling thread.  (Used by InstrCount.)
+unsigned long* InstrThreadInit(void) ;
+
+/// Sum the counters of all threads into count.
+void InstrSum(unsigned long count[NUMCOUNTERS]) ;
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -37,18 +82,94 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
+/// Wall_time read on previous reset (~seconds)
+extern double InstrWall;  ///extern
+
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
+/// Basic kernels, whose bandwidth is measured by InstrCalibrate:
+/// copying bytes, mapping bytes through a table, transposing a byte matrix
+enum { INSTR_MEMCPY, INSTR_LUT, INSTR_TRANSPOSE, INSTR_KERNELS };
+
+/// Bandwidth of each kernel (bytes read and written per second, by plain
+/// C code in one thread; 0 until calibrated)
+extern double InstrBandwidth[INSTR_KERNELS];  ///extern
+
+/// Output formats of InstrPrint
+enum { INSTR_TEXT, INSTR_CSV, INSTR_JSON };
+
+/// Output format of InstrPrint (initially INSTR_TEXT)
+extern int InstrFormat;  ///extern
+
+/// Find the Calibrated Time Unit (CTU) and the bandwidth of the kernels.
 /// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
+/// a reasonably cpu-independent time unit, and time each kernel on
+/// buffers larger than the caches.
+/// This takes about a second, so the results are kept in a cache file,
+/// for each CPU model and frequency governor: $INSTR_CACHE if set (no
+/// cache if empty), or else instrumentation in $XDG_CACHE_HOME or ~/.cache.
+/// Only the first call in a process does anything.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Start counting hardware events (CPU cycles, instructions, cache misses,
+/// branch misses) and page faults of the process, with perf_event_open
+/// (Linux only).  Events the kernel does not allow (or the CPU does not
+/// have) are skipped.  Threads created after this call are counted too,
+/// so call it before starting threads.  Counted events are shown by
+/// InstrPrint (since the last InstrReset), in total and for each region.
+/// Returns the number of events counted (0 if none).
+int InstrEventsOpen(void) ;
+
+/// Reset counters and regions to zero and store cpu_time and wall_time.
 void InstrReset(void) ;
 
+/// Start a region named name, inside the current region of the calling
+/// thread (if any).  name must remain valid (a string literal, or __func__).
+void InstrBegin(const char* name) ;
+
+/// End the current region of the calling thread, adding its times and
+/// the changes of the counters to the region totals.
+void InstrEnd(void) ;
+
+/// Declare that the calling thread moved bytes bytes (read and written)
+/// with a kernel like kernel (INSTR_MEMCPY, ...).  They are added to the
+/// regions of the thread being timed, and InstrPrint shows the efficiency
+/// of each region: the time its kernels take at the calibrated bandwidths,
+/// over its wall time.  (Above 1 if it does better than plain C code,
+/// with vector instructions or threads.)
+void InstrKernel(int kernel, unsigned long long bytes) ;
+
+/// Nonzero while a trace is recorded (see InstrTraceOpen)
+extern int InstrTracing;  ///extern
+
+/// Start recording a trace: each region (InstrBegin to InstrEnd) of each
+/// thread, and each span (InstrSpanBegin to InstrSpanEnd), is recorded with
+/// its times and the changes of the named counters and counted events.
+/// InstrTraceClose writes them to filename in Chrome Trace Event format
+/// (JSON), which trace viewers (chrome://tracing, ui.perfetto.dev) show
+/// as a timeline per thread.
+/// Returns 0 (with errno set) if filename cannot be created.
+int InstrTraceOpen(const char* filename) ;
+
+/// Start a span of the calling thread: like a region, but only recorded
+/// in the trace (not in the totals of InstrPrint), with the changes of the
+/// counters of all threads (if all is nonzero) or of the calling thread.
+/// Does nothing if no trace is recorded.
+void InstrSpanBegin(int all) ;
+
+/// End the current span of the calling thread, and record it with the
+/// given name and detail (which may be NULL).  (Both strings are copied.)
+void InstrSpanEnd(const char* name, const char* detail) ;
+
+/// Stop recording the trace and write it.
+/// Returns 0 (with errno set) on failure.
+int InstrTraceClose(void) ;
+
+/// Print times and all named counter values since the last reset,
+/// followed by the totals of each region, in the format InstrFormat.
+/// Calibrates (see InstrCalibrate) if that was not done yet, leaving the
+/// calibration out of the times and events of this report and later ones.
 void InstrPrint(void) ;
 
 #endif
-
@@ -0,0 +1,842 @@
+/// simd - Vectorized pixel kernels with runtime CPU dispatch.
+///
+/// See simd.h for usage.
+///
+/// Every kernel exists in a scalar version and, on x86 with GCC or Clang,
+/// in SSE2, AVX2 and AVX-512 (BW) versions compiled with target
+/// attributes, so the rest of the program needs no special flags.
+/// The vector versions handle the last (n mod width) pixels with the
+/// scalar code.
+///
+/// All versions must round exactly alike, so multiplies and adds are never
+/// fused (into FMA instructions, which round once): the blends and the FFT
+/// butterflies depend on it.  This is set here, not by compiler flags.
+
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// Level in use
+static int level = SIMD_SCALAR;
+
+// Nonzero if AVX-512 VBMI (byte permutes) may be used (requires level AVX512)
+static int vbmi = 0;
+
+static const char* names[SIMD_LEVELS] = { "scalar", "sse2", "avx2", "avx512" };
+
+/// Name of a level.
+const char* SimdLevelName(int lvl) { ///
+  return (0 <= lvl && lvl < SIMD_LEVELS) ? names[lvl] : "?";
+}
+
+/// Current level.
+int SimdLevel(void) { ///
+  return level;
+}
+
+// Is level lvl supported by this CPU (and OS)?
+static int supported(int lvl) {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  switch (lvl) {
+  case SIMD_SCALAR: return 1;
+  case SIMD_SSE2: return __builtin_cpu_supports("sse2");
+  case SIMD_AVX2: return __builtin_cpu_supports("avx2");
+  case SIMD_AVX512: return __builtin_cpu_supports("avx512bw");
+  }
+  return 0;
+#else
+  return lvl == SIMD_SCALAR;
+#endif
+}
+
+/// Use the given level, or the best supported level below it.
+int SimdSetLevel(int lvl) { ///
+  if (lvl >= SIMD_LEVELS) lvl = SIMD_LEVELS - 1;
+  while (lvl > SIMD_SCALAR && !supported(lvl))
+    lvl--;
+  level = lvl < SIMD_SCALAR ? SIMD_SCALAR : lvl;
+#ifdef SIMD_X86
+  vbmi = level == SIMD_AVX512 && __builtin_cpu_supports("avx512vbmi");
+#endif
+  return level;
+}
+
+/// Select the best level supported by the CPU (or forced by IMAGE8BIT_SIMD).
+void SimdInit(void) { ///
+  int lvl = SIMD_LEVELS - 1;
+  const char* env = getenv("IMAGE8BIT_SIMD");
+  if (env != NULL) {
+    for (int i = 0; i < SIMD_LEVELS; i++)
+      if (strcmp(env, names[i]) == 0) lvl = i;
+  }
+  SimdSetLevel(lvl);
+}
+
+
+// Scalar kernels (also used for the tails of the vector kernels)
+
+static void negativeScalar(uint8_t* p, size_t n, uint8_t maxval) {
+  for (size_t i = 0; i < n; i++)
+    p[i] = maxval - p[i];
+}
+
+static void thresholdScalar(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval) {
+  for (size_t i = 0; i < n; i++)
+    p[i] = p[i] < thr ? 0 : maxval;
+}
+
+static void lutScalar(uint8_t* p, size_t n, const uint8_t lut[256]) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint8_t a = lut[p[i]], b = lut[p[i+1]], c = lut[p[i+2]], d = lut[p[i+3]];
+    p[i] = a; p[i+1] = b; p[i+2] = c; p[i+3] = d;
+  }
+  for (; i < n; i++)
+    p[i] = lut[p[i]];
+}
+
+static void butterflyScalar(double* ra, double* ia, double* rb, double* ib, size_t n,
+                            const double* wr, const double* wi, size_t ws, double sign) {
+  for (size_t k = 0; k < n; k++) {
+    double c = wr[k * ws], s = sign * wi[k * ws];
+    double tr = rb[k] * c - ib[k] * s;
+    double ti = rb[k] * s + ib[k] * c;
+    rb[k] = ra[k] - tr;
+    ib[k] = ia[k] - ti;
+    ra[k] += tr;
+    ia[k] += ti;
+  }
+}
+
+static void blendScalar(uint8_t* dst, const uint8_t* src, size_t n, double alpha, uint8_t maxval) {
+  for (size_t i = 0; i < n; i++) {
+    double v = alpha * src[i] + (1.0 - alpha) * dst[i] + 0.5;
+    v = v < 0.0 ? 0.0 : v;
+    v = v > maxval ? maxval : v;
+    dst[i] = (uint8_t)v;
+  }
+}
+
+static void blendMaskScalar(uint8_t* dst, const uint8_t* src, const uint8_t* mask, size_t n,
+                            uint8_t maskmax, uint8_t maxval) {
+  for (size_t i = 0; i < n; i++) {
+    int v = (mask[i] * src[i] + (maskmax - mask[i]) * dst[i] + maskmax / 2) / maskmax;
+    dst[i] = v > maxval ? maxval : (uint8_t)v;
+  }
+}
+
+static void packBitsScalar(uint8_t* bits, const uint8_t* p, size_t n, uint8_t thr) {
+  for (size_t i = 0; i < n; i += 8) {
+    unsigned b = 0;
+    for (size_t j = i; j < i + 8; j++)
+      b = (b << 1) | (j < n && p[j] < thr);
+    bits[i / 8] = (uint8_t)b;
+  }
+}
+
+static void unpackBitsScalar(uint8_t* p, const uint8_t* bits, size_t n, uint8_t black, uint8_t white) {
+  for (size_t i = 0; i < n; i++)
+    p[i] = (bits[i / 8] >> (7 - i % 8)) & 1 ? black : white;
+}
+
+static uint64_t popcountScalar(const uint64_t* w, size_t n) {
+  uint64_t c = 0;
+  for (size_t i = 0; i < n; i++)
+    c += __builtin_popcountll(w[i]);
+  return c;
+}
+
+static void transposeScalar(const uint8_t* src, ptrdiff_t sstride, uint8_t* dst, ptrdiff_t dstride, int w, int h) {
+  for (int k = 0; k < w; k++)
+    for (int r = 0; r < h; r++)
+      dst[k * dstride + r] = src[r * sstride + k];
+}
+
+static void brightenScalar(uint8_t* p, size_t n, const struct simdbrighten* bp) {
+  for (size_t i = 0; i < n; i++) {
+    int v = (p[i] * bp->mul + bp->add) >> bp->shift;
+    p[i] = v > bp->maxval ? bp->maxval : (uint8_t)v;
+  }
+}
+
+/// Find a fixed-point form of brightening by factor that is exact for all
+/// 256 levels.
+/// The reference is the double precision computation:
+///   p*factor > maxval ? maxval : (uint8)(p*factor + 0.5)
+/// Candidates use the largest shift for which mul fits in 15 bits, plus
+/// neighbouring values of mul and add; each is checked on every level.
+int SimdBrightenPrepare(double factor, uint8_t maxval, struct simdbrighten* bp) { ///
+  uint8_t ref[256];
+  for (int p = 0; p < 256; p++) {
+    double intensity = p;
+    intensity *= factor;
+    ref[p] = intensity > maxval ? maxval : (uint8_t)(intensity + 0.5);
+  }
+  bp->maxval = maxval;
+
+  // Every level except 0 saturates
+  if (factor > maxval) {
+    bp->mul = 32767;
+    bp->add = 0;
+    bp->shift = 0;
+    return 1;
+  }
+
+  for (int shift = 15; shift >= 0; shift--) {
+    double m = factor * (double)(1 << shift);
+    if (m + 1.0 > 32767.0) continue;
+    int half = shift > 0 ? 1 << (shift - 1) : 0;
+    int mul0 = (int)(m + 0.5);
+    for (int dm = 0; dm <= 2; dm++) {
+      int mul = mul0 + (dm == 1 ? -1 : dm == 2 ? 1 : 0);
+      if (mul < 0) continue;
+      for (int da = 0; da <= 2; da++) {
+        int add = half + (da == 1 ? -1 : da == 2 ? 1 : 0);
+        if (add < 0 || add > 32767) continue;
+        int p = 0;
+        while (p < 256) {
+          int v = (p * mul + add) >> shift;
+          if ((v > maxval ? maxval : v) != ref[p]) break;
+          p++;
+        }
+        if (p == 256) {
+          bp->mul = (int16_t)mul;
+          bp->add = (int16_t)add;
+          bp->shift = shift;
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+
+#ifdef SIMD_X86
+
+// SSE2 kernels: 16 pixels per iteration
+
+__attribute__((target("sse2")))
+static void negativeSSE2(uint8_t* p, size_t n, uint8_t maxval) {
+  __m128i m = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+    _mm_storeu_si128((__m128i*)(p + i), _mm_sub_epi8(m, v));
+  }
+  negativeScalar(p + i, n - i, maxval);
+}
+
+__attribute__((target("sse2")))
+static void thresholdSSE2(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval) {
+  __m128i m = _mm_set1_epi8((char)maxval);
+  __m128i t = _mm_set1_epi8((char)thr);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);  // v >= thr
+    _mm_storeu_si128((__m128i*)(p + i), _mm_and_si128(ge, m));
+  }
+  thresholdScalar(p + i, n - i, thr, maxval);
+}
+
+// Pixels are widened to pairs (p, 1) of 16-bit words, so that a single
+// madd computes p*mul + add in 32 bits.
+__attribute__((target("sse2")))
+static void brightenSSE2(uint8_t* p, size_t n, const struct simdbrighten* bp) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i one = _mm_set1_epi16(1);
+  __m128i coef = _mm_set1_epi32((int)(((uint32_t)(uint16_t)bp->add << 16) | (uint16_t)bp->mul));
+  __m128i shift = _mm_cvtsi32_si128(bp->shift);
+  __m128i m = _mm_set1_epi8((char)bp->maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i a = _mm_sra_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(lo, one), coef), shift);
+    __m128i b = _mm_sra_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(lo, one), coef), shift);
+    __m128i c = _mm_sra_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(hi, one), coef), shift);
+    __m128i d = _mm_sra_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(hi, one), coef), shift);
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    _mm_storeu_si128((__m128i*)(p + i), _mm_min_epu8(r, m));
+  }
+  brightenScalar(p + i, n - i, bp);
+}
+
+// Transpose an 8x8 byte block held in 8 rows of 8 bytes, by interleaving
+// bytes, then words, then double words.
+__attribute__((target("sse2")))
+static void transpose8x8SSE2(const uint8_t* src, ptrdiff_t sstride, uint8_t* dst, ptrdiff_t dstride) {
+  __m128i a0 = _mm_loadl_epi64((const __m128i*)(src));
+  __m128i a1 = _mm_loadl_epi64((const __m128i*)(src + sstride));
+  __m128i a2 = _mm_loadl_epi64((const __m128i*)(src + 2 * sstride));
+  __m128i a3 = _mm_loadl_epi64((const __m128i*)(src + 3 * sstride));
+  __m128i a4 = _mm_loadl_epi64((const __m128i*)(src + 4 * sstride));
+  __m128i a5 = _mm_loadl_epi64((const __m128i*)(src + 5 * sstride));
+  __m128i a6 = _mm_loadl_epi64((const __m128i*)(src + 6 * sstride));
+  __m128i a7 = _mm_loadl_epi64((const __m128i*)(src + 7 * sstride));
+  __m128i t0 = _mm_unpacklo_epi8(a0, a1);
+  __m128i t1 = _mm_unpacklo_epi8(a2, a3);
+  __m128i t2 = _mm_unpacklo_epi8(a4, a5);
+  __m128i t3 = _mm_unpacklo_epi8(a6, a7);
+  __m128i u0 = _mm_unpacklo_epi16(t0, t1);  // columns 0-3 of rows 0-3
+  __m128i u1 = _mm_unpackhi_epi16(t0, t1);  // columns 4-7 of rows 0-3
+  __m128i u2 = _mm_unpacklo_epi16(t2, t3);  // columns 0-3 of rows 4-7
+  __m128i u3 = _mm_unpackhi_epi16(t2, t3);  // columns 4-7 of rows 4-7
+  __m128i v0 = _mm_unpacklo_epi32(u0, u2);  // columns 0 and 1
+  __m128i v1 = _mm_unpackhi_epi32(u0, u2);  // columns 2 and 3
+  __m128i v2 = _mm_unpacklo_epi32(u1, u3);  // columns 4 and 5
+  __m128i v3 = _mm_unpackhi_epi32(u1, u3);  // columns 6 and 7
+  _mm_storel_epi64((__m128i*)(dst), v0);
+  _mm_storel_epi64((__m128i*)(dst + dstride), _mm_unpackhi_epi64(v0, v0));
+  _mm_storel_epi64((__m128i*)(dst + 2 * dstride), v1);
+  _mm_storel_epi64((__m128i*)(dst + 3 * dstride), _mm_unpackhi_epi64(v1, v1));
+  _mm_storel_epi64((__m128i*)(dst + 4 * dstride), v2);
+  _mm_storel_epi64((__m128i*)(dst + 5 * dstride), _mm_unpackhi_epi64(v2, v2));
+  _mm_storel_epi64((__m128i*)(dst + 6 * dstride), v3);
+  _mm_storel_epi64((__m128i*)(dst + 7 * dstride), _mm_unpackhi_epi64(v3, v3));
+}
+
+static void transposeSSE2(const uint8_t* src, ptrdiff_t sstride, uint8_t* dst, ptrdiff_t dstride, int w, int h) {
+  int w8 = w & ~7;
+  int h8 = h & ~7;
+  for (int r = 0; r < h8; r += 8)
+    for (int k = 0; k < w8; k += 8)
+      transpose8x8SSE2(src + r * sstride + k, sstride, dst + k * dstride + r, dstride);
+  // Right and bottom edges
+  transposeScalar(src + w8, sstride, dst + w8 * dstride, dstride, w - w8, h);
+  transposeScalar(src + h8 * sstride, sstride, dst + h8, dstride, w8, h - h8);
+}
+
+__attribute__((target("sse2")))
+static void butterflySSE2(double* ra, double* ia, double* rb, double* ib, size_t n,
+                          const double* wr, const double* wi, size_t ws, double sign) {
+  __m128d sg = _mm_set1_pd(sign);
+  __m128d c = _mm_set1_pd(wr[0]);
+  __m128d s = _mm_mul_pd(sg, _mm_set1_pd(wi[0]));
+  size_t k = 0;
+  for (; k + 2 <= n; k += 2) {
+    if (ws != 0) {
+      c = _mm_loadu_pd(wr + k);
+      s = _mm_mul_pd(sg, _mm_loadu_pd(wi + k));
+    }
+    __m128d br = _mm_loadu_pd(rb + k), bi = _mm_loadu_pd(ib + k);
+    __m128d ar = _mm_loadu_pd(ra + k), ai = _mm_loadu_pd(ia + k);
+    __m128d tr = _mm_sub_pd(_mm_mul_pd(br, c), _mm_mul_pd(bi, s));
+    __m128d ti = _mm_add_pd(_mm_mul_pd(br, s), _mm_mul_pd(bi, c));
+    _mm_storeu_pd(rb + k, _mm_sub_pd(ar, tr));
+    _mm_storeu_pd(ib + k, _mm_sub_pd(ai, ti));
+    _mm_storeu_pd(ra + k, _mm_add_pd(ar, tr));
+    _mm_storeu_pd(ia + k, _mm_add_pd(ai, ti));
+  }
+  butterflyScalar(ra + k, ia + k, rb + k, ib + k, n - k, wr + k * ws, wi + k * ws, ws, sign);
+}
+
+// x/255 for 16-bit x <= 65152: (x + (x >> 8) + 1) >> 8
+__attribute__((target("sse2")))
+static void blendMaskSSE2(uint8_t* dst, const uint8_t* src, const uint8_t* mask, size_t n, uint8_t maxval) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i m255 = _mm_set1_epi16(255);
+  __m128i half = _mm_set1_epi16(127);
+  __m128i one = _mm_set1_epi16(1);
+  __m128i mv = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i m = _mm_loadu_si128((const __m128i*)(mask + i));
+    __m128i r[2];
+    for (int h = 0; h < 2; h++) {
+      __m128i s16 = h ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+      __m128i d16 = h ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+      __m128i m16 = h ? _mm_unpackhi_epi8(m, zero) : _mm_unpacklo_epi8(m, zero);
+      __m128i x = _mm_add_epi16(_mm_mullo_epi16(m16, s16), _mm_mullo_epi16(_mm_sub_epi16(m255, m16), d16));
+      x = _mm_add_epi16(x, half);
+      r[h] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), one), 8);
+    }
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_min_epu8(_mm_packus_epi16(r[0], r[1]), mv));
+  }
+  blendMaskScalar(dst + i, src + i, mask + i, n - i, 255, maxval);
+}
+
+// AVX2 kernels: 32 pixels per iteration
+// (unpack and pack work within 128-bit lanes, so the order is preserved)
+
+__attribute__((target("avx2")))
+static void negativeAVX2(uint8_t* p, size_t n, uint8_t maxval) {
+  __m256i m = _mm256_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_sub_epi8(m, v));
+  }
+  negativeScalar(p + i, n - i, maxval);
+}
+
+__attribute__((target("avx2")))
+static void thresholdAVX2(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval) {
+  __m256i m = _mm256_set1_epi8((char)maxval);
+  __m256i t = _mm256_set1_epi8((char)thr);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+    __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v);  // v >= thr
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_and_si256(ge, m));
+  }
+  thresholdScalar(p + i, n - i, thr, maxval);
+}
+
+__attribute__((target("avx2")))
+static void brightenAVX2(uint8_t* p, size_t n, const struct simdbrighten* bp) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i one = _mm256_set1_epi16(1);
+  __m256i coef = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)bp->add << 16) | (uint16_t)bp->mul));
+  __m128i shift = _mm_cvtsi32_si128(bp->shift);
+  __m256i m = _mm256_set1_epi8((char)bp->maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+    __m256i lo = _mm256_unpacklo_epi8(v, zero);
+    __m256i hi = _mm256_unpackhi_epi8(v, zero);
+    __m256i a = _mm256_sra_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(lo, one), coef), shift);
+    __m256i b = _mm256_sra_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(lo, one), coef), shift);
+    __m256i c = _mm256_sra_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(hi, one), coef), shift);
+    __m256i d = _mm256_sra_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(hi, one), coef), shift);
+    __m256i r = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_min_epu8(r, m));
+  }
+  brightenScalar(p + i, n - i, bp);
+}
+
+__attribute__((target("avx2")))
+static void butterflyAVX2(double* ra, double* ia, double* rb, double* ib, size_t n,
+                          const double* wr, const double* wi, size_t ws, double sign) {
+  __m256d sg = _mm256_set1_pd(sign);
+  __m256d c = _mm256_set1_pd(wr[0]);
+  __m256d s = _mm256_mul_pd(sg, _mm256_set1_pd(wi[0]));
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    if (ws != 0) {
+      c = _mm256_loadu_pd(wr + k);
+      s = _mm256_mul_pd(sg, _mm256_loadu_pd(wi + k));
+    }
+    __m256d br = _mm256_loadu_pd(rb + k), bi = _mm256_loadu_pd(ib + k);
+    __m256d ar = _mm256_loadu_pd(ra + k), ai = _mm256_loadu_pd(ia + k);
+    __m256d tr = _mm256_sub_pd(_mm256_mul_pd(br, c), _mm256_mul_pd(bi, s));
+    __m256d ti = _mm256_add_pd(_mm256_mul_pd(br, s), _mm256_mul_pd(bi, c));
+    _mm256_storeu_pd(rb + k, _mm256_sub_pd(ar, tr));
+    _mm256_storeu_pd(ib + k, _mm256_sub_pd(ai, ti));
+    _mm256_storeu_pd(ra + k, _mm256_add_pd(ar, tr));
+    _mm256_storeu_pd(ia + k, _mm256_add_pd(ai, ti));
+  }
+  _mm256_zeroupper();  // the scalar code is not VEX-encoded
+  butterflyScalar(ra + k, ia + k, rb + k, ib + k, n - k, wr + k * ws, wi + k * ws, ws, sign);
+}
+
+// Pixels are converted to doubles 4 at a time, and back to 32-bit integers
+__attribute__((target("avx2")))
+static void blendAVX2(uint8_t* dst, const uint8_t* src, size_t n, double alpha, uint8_t maxval) {
+  __m256d a = _mm256_set1_pd(alpha);
+  __m256d b = _mm256_set1_pd(1.0 - alpha);
+  __m256d half = _mm256_set1_pd(0.5);
+  __m256d zero = _mm256_setzero_pd();
+  __m256d mv = _mm256_set1_pd(maxval);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i s8 = _mm_loadl_epi64((const __m128i*)(src + i));
+    __m128i d8 = _mm_loadl_epi64((const __m128i*)(dst + i));
+    __m128i r[2];
+    for (int h = 0; h < 2; h++) {
+      __m256d s = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(h ? _mm_srli_si128(s8, 4) : s8));
+      __m256d d = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(h ? _mm_srli_si128(d8, 4) : d8));
+      __m256d v = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a, s), _mm256_mul_pd(b, d)), half);
+      v = _mm256_min_pd(_mm256_max_pd(v, zero), mv);
+      r[h] = _mm256_cvttpd_epi32(v);
+    }
+    __m128i p = _mm_packs_epi32(r[0], r[1]);
+    _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(p, p));
+  }
+  _mm256_zeroupper();  // the scalar code is not VEX-encoded
+  blendScalar(dst + i, src + i, n - i, alpha, maxval);
+}
+
+__attribute__((target("avx2")))
+static void blendMaskAVX2(uint8_t* dst, const uint8_t* src, const uint8_t* mask, size_t n, uint8_t maxval) {
+  __m256i m255 = _mm256_set1_epi16(255);
+  __m256i half = _mm256_set1_epi16(127);
+  __m256i one = _mm256_set1_epi16(1);
+  __m128i mv = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i)));
+    __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(dst + i)));
+    __m256i m = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(mask + i)));
+    __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(m, s), _mm256_mullo_epi16(_mm256_sub_epi16(m255, m), d));
+    x = _mm256_add_epi16(x, half);
+    x = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), one), 8);
+    __m128i r = _mm_packus_epi16(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_min_epu8(r, mv));
+  }
+  _mm256_zeroupper();  // the scalar code is not VEX-encoded
+  blendMaskScalar(dst + i, src + i, mask + i, n - i, 255, maxval);
+}
+
+// Bit i of a byte mask is level i, but the bitmap wants the first level
+// in the most significant bit: reverse each group of 8 levels first.
+// thr == 0 sets no bits, and is left to the scalar code.
+__attribute__((target("avx2")))
+static void packBitsAVX2(uint8_t* bits, const uint8_t* p, size_t n, uint8_t thr) {
+  const __m256i rev = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                       7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  __m256i t = _mm256_set1_epi8((char)(thr - 1));
+  size_t i = 0;
+  if (thr > 0) {
+    for (; i + 32 <= n; i += 32) {
+      __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), rev);
+      __m256i lt = _mm256_cmpeq_epi8(_mm256_min_epu8(v, t), v);   // v <= thr-1
+      uint32_t m = (uint32_t)_mm256_movemask_epi8(lt);
+      memcpy(bits + i / 8, &m, 4);  // byte k of m holds levels 8k..8k+7
+    }
+  }
+  _mm256_zeroupper();  // the scalar code is not VEX-encoded
+  packBitsScalar(bits + i / 8, p + i, n - i, thr);
+}
+
+// Each byte of bits is broadcast to 8 levels and tested against one bit each.
+__attribute__((target("avx2")))
+static void unpackBitsAVX2(uint8_t* p, const uint8_t* bits, size_t n, uint8_t black, uint8_t white) {
+  const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                          2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i sel = _mm256_set1_epi64x((long long)0x0102040810204080ULL);
+  __m256i b = _mm256_set1_epi8((char)black), w = _mm256_set1_epi8((char)white);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    uint32_t m;
+    memcpy(&m, bits + i / 8, 4);
+    __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32((int)m), spread);
+    __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(v, sel), sel);
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_blendv_epi8(w, b, set));
+  }
+  _mm256_zeroupper();
+  unpackBitsScalar(p + i, bits + i / 8, n - i, black, white);
+}
+
+// Every CPU with AVX2 has POPCNT
+__attribute__((target("popcnt")))
+static uint64_t popcountPOPCNT(const uint64_t* w, size_t n) {
+  uint64_t c = 0;
+  for (size_t i = 0; i < n; i++)
+    c += __builtin_popcountll(w[i]);
+  return c;
+}
+
+// AVX-512 kernels: 64 pixels per iteration
+
+__attribute__((target("avx512f,avx512bw")))
+static void negativeAVX512(uint8_t* p, size_t n, uint8_t maxval) {
+  __m512i m = _mm512_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512((void*)(p + i));
+    _mm512_storeu_si512((void*)(p + i), _mm512_sub_epi8(m, v));
+  }
+  negativeScalar(p + i, n - i, maxval);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void thresholdAVX512(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval) {
+  __m512i m = _mm512_set1_epi8((char)maxval);
+  __m512i t = _mm512_set1_epi8((char)thr);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512((void*)(p + i));
+    __mmask64 ge = _mm512_cmpge_epu8_mask(v, t);
+    _mm512_storeu_si512((void*)(p + i), _mm512_maskz_mov_epi8(ge, m));
+  }
+  thresholdScalar(p + i, n - i, thr, maxval);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void brightenAVX512(uint8_t* p, size_t n, const struct simdbrighten* bp) {
+  __m512i zero = _mm512_setzero_si512();
+  __m512i one = _mm512_set1_epi16(1);
+  __m512i coef = _mm512_set1_epi32((int)(((uint32_t)(uint16_t)bp->add << 16) | (uint16_t)bp->mul));
+  __m128i shift = _mm_cvtsi32_si128(bp->shift);
+  __m512i m = _mm512_set1_epi8((char)bp->maxval);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512((void*)(p + i));
+    __m512i lo = _mm512_unpacklo_epi8(v, zero);
+    __m512i hi = _mm512_unpackhi_epi8(v, zero);
+    __m512i a = _mm512_sra_epi32(_mm512_madd_epi16(_mm512_unpacklo_epi16(lo, one), coef), shift);
+    __m512i b = _mm512_sra_epi32(_mm512_madd_epi16(_mm512_unpackhi_epi16(lo, one), coef), shift);
+    __m512i c = _mm512_sra_epi32(_mm512_madd_epi16(_mm512_unpacklo_epi16(hi, one), coef), shift);
+    __m512i d = _mm512_sra_epi32(_mm512_madd_epi16(_mm512_unpackhi_epi16(hi, one), coef), shift);
+    __m512i r = _mm512_packus_epi16(_mm512_packs_epi32(a, b), _mm512_packs_epi32(c, d));
+    _mm512_storeu_si512((void*)(p + i), _mm512_min_epu8(r, m));
+  }
+  brightenScalar(p + i, n - i, bp);
+}
+
+// The 256-entry table is held in 4 registers; two 128-entry permutes
+// look up the low 7 bits and the top bit of each pixel selects between them.
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void lutVBMI(uint8_t* p, size_t n, const uint8_t lut[256]) {
+  __m512i t0 = _mm512_loadu_si512((const void*)(lut));
+  __m512i t1 = _mm512_loadu_si512((const void*)(lut + 64));
+  __m512i t2 = _mm512_loadu_si512((const void*)(lut + 128));
+  __m512i t3 = _mm512_loadu_si512((const void*)(lut + 192));
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512((void*)(p + i));
+    __m512i lo = _mm512_permutex2var_epi8(t0, v, t1);  // uses bits 0-6 of v
+    __m512i hi = _mm512_permutex2var_epi8(t2, v, t3);
+    __mmask64 top = _mm512_movepi8_mask(v);            // bit 7 of v
+    _mm512_storeu_si512((void*)(p + i), _mm512_mask_blend_epi8(top, lo, hi));
+  }
+  lutScalar(p + i, n - i, lut);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void blendAVX512(uint8_t* dst, const uint8_t* src, size_t n, double alpha, uint8_t maxval) {
+  __m512d a = _mm512_set1_pd(alpha);
+  __m512d b = _mm512_set1_pd(1.0 - alpha);
+  __m512d half = _mm512_set1_pd(0.5);
+  __m512d zero = _mm512_setzero_pd();
+  __m512d mv = _mm512_set1_pd(maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i s32 = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+    __m512i d32 = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(dst + i)));
+    __m256i r[2];
+    for (int h = 0; h < 2; h++) {
+      __m512d s = _mm512_cvtepi32_pd(h ? _mm512_extracti64x4_epi64(s32, 1) : _mm512_castsi512_si256(s32));
+      __m512d d = _mm512_cvtepi32_pd(h ? _mm512_extracti64x4_epi64(d32, 1) : _mm512_castsi512_si256(d32));
+      __m512d v = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(a, s), _mm512_mul_pd(b, d)), half);
+      v = _mm512_min_pd(_mm512_max_pd(v, zero), mv);
+      r[h] = _mm512_cvttpd_epi32(v);
+    }
+    __m512i v32 = _mm512_inserti64x4(_mm512_castsi256_si512(r[0]), r[1], 1);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm512_cvtepi32_epi8(v32));
+  }
+  _mm256_zeroupper();  // the scalar code is not VEX-encoded
+  blendScalar(dst + i, src + i, n - i, alpha, maxval);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void blendMaskAVX512(uint8_t* dst, const uint8_t* src, const uint8_t* mask, size_t n, uint8_t maxval) {
+  __m512i m255 = _mm512_set1_epi16(255);
+  __m512i half = _mm512_set1_epi16(127);
+  __m512i one = _mm512_set1_epi16(1);
+  __m256i mv = _mm256_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512i s = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(src + i)));
+    __m512i d = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(dst + i)));
+    __m512i m = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(mask + i)));
+    __m512i x = _mm512_add_epi16(_mm512_mullo_epi16(m, s), _mm512_mullo_epi16(_mm512_sub_epi16(m255, m), d));
+    x = _mm512_add_epi16(x, half);
+    x = _mm512_srli_epi16(_mm512_add_epi16(_mm512_add_epi16(x, _mm512_srli_epi16(x, 8)), one), 8);
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_min_epu8(_mm512_cvtepi16_epi8(x), mv));
+  }
+  _mm256_zeroupper();  // the scalar code is not VEX-encoded
+  blendMaskScalar(dst + i, src + i, mask + i, n - i, 255, maxval);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void packBitsAVX512(uint8_t* bits, const uint8_t* p, size_t n, uint8_t thr) {
+  const __m512i rev = _mm512_broadcast_i32x4(_mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+  __m512i t = _mm512_set1_epi8((char)thr);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i v = _mm512_shuffle_epi8(_mm512_loadu_si512((const void*)(p + i)), rev);
+    uint64_t m = _mm512_cmplt_epu8_mask(v, t);
+    memcpy(bits + i / 8, &m, 8);
+  }
+  _mm256_zeroupper();
+  packBitsScalar(bits + i / 8, p + i, n - i, thr);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void unpackBitsAVX512(uint8_t* p, const uint8_t* bits, size_t n, uint8_t black, uint8_t white) {
+  const __m512i spread = _mm512_set_epi64(0x0707070707070707LL, 0x0606060606060606LL,
+                                          0x0505050505050505LL, 0x0404040404040404LL,
+                                          0x0303030303030303LL, 0x0202020202020202LL,
+                                          0x0101010101010101LL, 0);
+  const __m512i sel = _mm512_set1_epi64((long long)0x0102040810204080ULL);
+  __m512i b = _mm512_set1_epi8((char)black), w = _mm512_set1_epi8((char)white);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    uint64_t m;
+    memcpy(&m, bits + i / 8, 8);
+    // Every 128-bit lane holds all of m, so an in-lane shuffle is enough
+    __m512i v = _mm512_shuffle_epi8(_mm512_set1_epi64((long long)m), spread);
+    __mmask64 set = _mm512_test_epi8_mask(v, sel);
+    _mm512_storeu_si512((void*)(p + i), _mm512_mask_blend_epi8(set, w, b));
+  }
+  _mm256_zeroupper();
+  unpackBitsScalar(p + i, bits + i / 8, n - i, black, white);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void butterflyAVX512(double* ra, double* ia, double* rb, double* ib, size_t n,
+                          const double* wr, const double* wi, size_t ws, double sign) {
+  __m512d sg = _mm512_set1_pd(sign);
+  __m512d c = _mm512_set1_pd(wr[0]);
+  __m512d s = _mm512_mul_pd(sg, _mm512_set1_pd(wi[0]));
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    if (ws != 0) {
+      c = _mm512_loadu_pd(wr + k);
+      s = _mm512_mul_pd(sg, _mm512_loadu_pd(wi + k));
+    }
+    __m512d br = _mm512_loadu_pd(rb + k), bi = _mm512_loadu_pd(ib + k);
+    __m512d ar = _mm512_loadu_pd(ra + k), ai = _mm512_loadu_pd(ia + k);
+    __m512d tr = _mm512_sub_pd(_mm512_mul_pd(br, c), _mm512_mul_pd(bi, s));
+    __m512d ti = _mm512_add_pd(_mm512_mul_pd(br, s), _mm512_mul_pd(bi, c));
+    _mm512_storeu_pd(rb + k, _mm512_sub_pd(ar, tr));
+    _mm512_storeu_pd(ib + k, _mm512_sub_pd(ai, ti));
+    _mm512_storeu_pd(ra + k, _mm512_add_pd(ar, tr));
+    _mm512_storeu_pd(ia + k, _mm512_add_pd(ai, ti));
+  }
+  _mm256_zeroupper();  // the scalar code is not VEX-encoded
+  butterflyScalar(ra + k, ia + k, rb + k, ib + k, n - k, wr + k * ws, wi + k * ws, ws, sign);
+}
+
+#endif  // SIMD_X86
+
+
+// Dispatch
+
+/// p[i] = maxval - p[i], for i in [0, n).
+void SimdNegative(uint8_t* p, size_t n, uint8_t maxval) { ///
+  switch (level) {
+#ifdef SIMD_X86
+  case SIMD_AVX512: negativeAVX512(p, n, maxval); return;
+  case SIMD_AVX2: negativeAVX2(p, n, maxval); return;
+  case SIMD_SSE2: negativeSSE2(p, n, maxval); return;
+#endif
+  default: negativeScalar(p, n, maxval);
+  }
+}
+
+/// p[i] = (p[i] < thr) ? 0 : maxval, for i in [0, n).
+void SimdThreshold(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval) { ///
+  switch (level) {
+#ifdef SIMD_X86
+  case SIMD_AVX512: thresholdAVX512(p, n, thr, maxval); return;
+  case SIMD_AVX2: thresholdAVX2(p, n, thr, maxval); return;
+  case SIMD_SSE2: thresholdSSE2(p, n, thr, maxval); return;
+#endif
+  default: thresholdScalar(p, n, thr, maxval);
+  }
+}
+
+/// p[i] = lut[p[i]], for i in [0, n).
+void SimdApplyLUT(uint8_t* p, size_t n, const uint8_t lut[256]) { ///
+#ifdef SIMD_X86
+  if (vbmi) { lutVBMI(p, n, lut); return; }
+#endif
+  lutScalar(p, n, lut);
+}
+
+/// Transpose a block of w columns by h rows.
+void SimdTranspose(const uint8_t* src, ptrdiff_t sstride, uint8_t* dst, ptrdiff_t dstride, int w, int h) { ///
+#ifdef SIMD_X86
+  if (level >= SIMD_SSE2) { transposeSSE2(src, sstride, dst, dstride, w, h); return; }
+#endif
+  transposeScalar(src, sstride, dst, dstride, w, h);
+}
+
+/// Blend src into dst with constant alpha.
+void SimdBlend(uint8_t* dst, const uint8_t* src, size_t n, double alpha, uint8_t maxval) { ///
+  switch (level) {
+#ifdef SIMD_X86
+  case SIMD_AVX512: blendAVX512(dst, src, n, alpha, maxval); return;
+  case SIMD_AVX2: blendAVX2(dst, src, n, alpha, maxval); return;
+#endif
+  default: blendScalar(dst, src, n, alpha, maxval);
+  }
+}
+
+/// Blend src into dst with per-pixel alpha mask[i]/maskmax.
+void SimdBlendMask(uint8_t* dst, const uint8_t* src, const uint8_t* mask, size_t n, uint8_t maskmax, uint8_t maxval) { ///
+  if (maskmax == 255) {
+    switch (level) {
+#ifdef SIMD_X86
+    case SIMD_AVX512: blendMaskAVX512(dst, src, mask, n, maxval); return;
+    case SIMD_AVX2: blendMaskAVX2(dst, src, mask, n, maxval); return;
+    case SIMD_SSE2: blendMaskSSE2(dst, src, mask, n, maxval); return;
+#endif
+    }
+  }
+  blendMaskScalar(dst, src, mask, n, maskmax, maxval);
+}
+
+/// FFT butterflies on n pairs of complex values.
+void SimdButterfly(double* ra, double* ia, double* rb, double* ib, size_t n,
+                   const double* wr, const double* wi, size_t ws, double sign) { ///
+  switch (level) {
+#ifdef SIMD_X86
+  case SIMD_AVX512: butterflyAVX512(ra, ia, rb, ib, n, wr, wi, ws, sign); return;
+  case SIMD_AVX2: butterflyAVX2(ra, ia, rb, ib, n, wr, wi, ws, sign); return;
+  case SIMD_SSE2: butterflySSE2(ra, ia, rb, ib, n, wr, wi, ws, sign); return;
+#endif
+  default: butterflyScalar(ra, ia, rb, ib, n, wr, wi, ws, sign);
+  }
+}
+
+/// Apply a brighten operation prepared by SimdBrightenPrepare to p[0..n).
+void SimdBrighten(uint8_t* p, size_t n, const struct simdbrighten* bp) { ///
+  switch (level) {
+#ifdef SIMD_X86
+  case SIMD_AVX512: brightenAVX512(p, n, bp); return;
+  case SIMD_AVX2: brightenAVX2(p, n, bp); return;
+  case SIMD_SSE2: brightenSSE2(p, n, bp); return;
+#endif
+  default: brightenScalar(p, n, bp);
+  }
+}
+
+/// Pack n levels into bits, 8 per byte (bit set if level < thr).
+void SimdPackBits(uint8_t* bits, const uint8_t* p, size_t n, uint8_t thr) { ///
+  switch (level) {
+#ifdef SIMD_X86
+  case SIMD_AVX512: packBitsAVX512(bits, p, n, thr); return;
+  case SIMD_AVX2: packBitsAVX2(bits, p, n, thr); return;
+#endif
+  default: packBitsScalar(bits, p, n, thr);
+  }
+}
+
+/// Unpack n bits into levels black (set) or white (clear).
+void SimdUnpackBits(uint8_t* p, const uint8_t* bits, size_t n, uint8_t black, uint8_t white) { ///
+  switch (level) {
+#ifdef SIMD_X86
+  case SIMD_AVX512: unpackBitsAVX512(p, bits, n, black, white); return;
+  case SIMD_AVX2: unpackBitsAVX2(p, bits, n, black, white); return;
+#endif
+  default: unpackBitsScalar(p, bits, n, black, white);
+  }
+}
+
+/// Number of set bits in w[0..n).
+uint64_t SimdPopcount(const uint64_t* w, size_t n) { ///
+#ifdef SIMD_X86
+  if (level >= SIMD_AVX2) return popcountPOPCNT(w, n);
+#endif
+  return popcountScalar(w, n);
+}
@@ -0,0 +1,101 @@
+/// simd - Vectorized pixel kernels with runtime CPU dispatch.
+///
+/// Used internally by the image8bit module.
+/// Each kernel processes a contiguous run of n pixels, using the widest
+/// instruction set available (SSE2, AVX2 or AVX-512), and gives exactly
+/// the same results as the scalar code it replaces.
+///
+/// SimdInit() selects the level from the CPU (through CPUID).
+/// Setting the environment variable IMAGE8BIT_SIMD to scalar, sse2, avx2 or
+/// avx512 forces a lower level (for testing and benchmarking).
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Instruction set levels
+enum { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512, SIMD_LEVELS };
+
+/// Select the best level supported by the CPU (or forced by IMAGE8BIT_SIMD).
+void SimdInit(void) ;
+
+/// Use the given level, or the best supported level below it.
+/// Returns the level actually selected.
+int SimdSetLevel(int level) ;
+
+/// Current level.
+int SimdLevel(void) ;
+
+/// Name of a level ("scalar", "sse2", "avx2" or "avx512").
+const char* SimdLevelName(int level) ;
+
+/// p[i] = maxval - p[i]  (modulo 256), for i in [0, n).
+void SimdNegative(uint8_t* p, size_t n, uint8_t maxval) ;
+
+/// p[i] = (p[i] < thr) ? 0 : maxval, for i in [0, n).
+void SimdThreshold(uint8_t* p, size_t n, uint8_t thr, uint8_t maxval) ;
+
+/// p[i] = lut[p[i]], for i in [0, n).
+/// Vectorized only with AVX-512 VBMI (byte permutes); scalar otherwise.
+void SimdApplyLUT(uint8_t* p, size_t n, const uint8_t lut[256]) ;
+
+/// Transpose a block of w columns by h rows: dst row k, byte r gets
+/// src row r, byte k (for 0 <= k < w, 0 <= r < h).
+/// Strides are in bytes and may be negative (to flip rows).
+/// Uses 8x8 byte transposes in registers (SSE2) for the bulk of the block.
+void SimdTranspose(const uint8_t* src, ptrdiff_t sstride, uint8_t* dst, ptrdiff_t dstride, int w, int h) ;
+
+/// FFT butterflies on n pairs of complex values (SoA: real and imaginary
+/// parts in separate arrays): with w = wr[k*ws] + i*sign*wi[k*ws],
+/// b[k] becomes a[k] - w*b[k] and a[k] becomes a[k] + w*b[k].
+/// ws is 0 (the same twiddle factor for all k) or 1; sign is 1 or -1.
+void SimdButterfly(double* ra, double* ia, double* rb, double* ib, size_t n,
+                   const double* wr, const double* wi, size_t ws, double sign) ;
+
+/// Blend src into dst with constant alpha:
+/// dst[i] becomes alpha*src[i] + (1-alpha)*dst[i] + 0.5 (in double precision,
+/// in this order), saturated to [0, maxval] and truncated, for i in [0, n).
+/// Vectorized with AVX2 and AVX-512 (doubles); the same operations are done
+/// in the same order, so results are exactly those of the scalar code.
+void SimdBlend(uint8_t* dst, const uint8_t* src, size_t n, double alpha, uint8_t maxval) ;
+
+/// Blend src into dst with per-pixel alpha mask[i]/maskmax:
+/// dst[i] becomes (mask[i]*src[i] + (maskmax-mask[i])*dst[i] + maskmax/2) / maskmax
+/// (integer division, so rounded to nearest), limited to maxval, for i in [0, n).
+/// Requires: 0 < maskmax and mask[i] <= maskmax.
+/// Vectorized (16-bit fixed point) for maskmax 255; scalar otherwise.
+void SimdBlendMask(uint8_t* dst, const uint8_t* src, const uint8_t* mask, size_t n, uint8_t maskmax, uint8_t maxval) ;
+
+/// Pack n levels into bits, 8 per byte, first level in the most significant
+/// bit: a bit is set if its level is < thr.  Writes (n+7)/8 bytes; the
+/// unused low bits of the last byte are cleared.
+void SimdPackBits(uint8_t* bits, const uint8_t* p, size_t n, uint8_t thr) ;
+
+/// Unpack n bits, as stored by SimdPackBits, into levels:
+/// p[i] = bit i set ? black : white, for i in [0, n).
+void SimdUnpackBits(uint8_t* p, const uint8_t* bits, size_t n, uint8_t black, uint8_t white) ;
+
+/// Number of set bits in w[0..n).
+/// Uses the POPCNT instruction at level AVX2 or above.
+uint64_t SimdPopcount(const uint64_t* w, size_t n) ;
+
+/// Fixed-point form of a brighten operation:
+/// p becomes min(maxval, (p*mul + add) >> shift).
+struct simdbrighten {
+  int16_t mul;
+  int16_t add;
+  int shift;
+  uint8_t maxval;
+};
+
+/// Find a fixed-point form of brightening by factor (with saturation at
+/// maxval and +0.5 rounding) that is exact for all 256 levels.
+/// Returns 1 and fills *bp on success, 0 if there is none.
+int SimdBrightenPrepare(double factor, uint8_t maxval, struct simdbrighten* bp) ;
+
+/// Apply a brighten operation prepared by SimdBrightenPrepare to p[0..n).
+void SimdBrighten(uint8_t* p, size_t n, const struct simdbrighten* bp) ;
+
+#endif
@@ -0,0 +1,168 @@
+/// threadpool - A small pool of worker threads.
+///
+/// See threadpool.h for usage.
+///
+/// The calling thread always processes band 0 itself; worker threads
+/// (created on first need) process bands 1, 2, ...
+/// Workers sleep on a condition variable between jobs.
+
+#include "threadpool.h"
+#include "instrumentation.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Number of threads wanted (including the calling thread)
+static int nthreads = 1;
+
+// Worker threads currently running
+static int nworkers = 0;
+static pthread_t workers[POOL_MAX_THREADS];
+
+// Protects the job description and counters below
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER;  // a new job (or quit)
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;   // all bands finished
+
+// Current job
+static PoolTask jobTask;
+static void* jobArg;
+static int jobN;
+static int jobBands;
+static unsigned long generation = 0;  // incremented for each new job
+static unsigned long spawned = 0;     // generation when workers were last created
+static int pending = 0;               // bands of the job not yet finished
+static int quit = 0;                  // tell workers to terminate
+
+// Nonzero in worker threads and while the caller runs its band
+static __thread int insideTask = 0;
+
+// Bounds of band b when [0, n) is split into bands parts
+static void bandRange(int n, int bands, int b, int* lo, int* hi) {
+  *lo = (int)((long long)n * b / bands);
+  *hi = (int)((long long)n * (b + 1) / bands);
+}
+
+// Run band b (of bands) of task, recorded as a span if a trace is recorded
+static void runBand(PoolTask task, void* arg, int b, int bands, int lo, int hi) {
+#if INSTR_LEVEL >= 1
+  if (InstrTracing) {
+    char detail[64];
+    snprintf(detail, sizeof(detail), "band %d of %d: [%d, %d)", b, bands, lo, hi);
+    InstrSpanBegin(0);
+    task(arg, b, lo, hi);
+    InstrSpanEnd("band", detail);
+    return;
+  }
+#else
+  (void)bands;
+#endif
+  task(arg, b, lo, hi);
+}
+
+// Worker thread: runs band (id+1) of every job that has it
+static void* worker(void* p) {
+  int b = (int)(intptr_t)p + 1;
+  insideTask = 1;
+  pthread_mutex_lock(&lock);
+  unsigned long seen = spawned;  // jobs before this one did not need us
+  for (;;) {
+    while (!quit && generation == seen)
+      pthread_cond_wait(&start, &lock);
+    if (quit) break;
+    seen = generation;
+    if (b < jobBands) {
+      PoolTask task = jobTask;
+      void* arg = jobArg;
+      int bands = jobBands;
+      int lo, hi;
+      bandRange(jobN, bands, b, &lo, &hi);
+      pthread_mutex_unlock(&lock);
+      runBand(task, arg, b, bands, lo, hi);
+      pthread_mutex_lock(&lock);
+      // (broadcast, though there is a single waiter: pthread_cond_signal
+      // may lose the wakeup in glibc < 2.41, bug 25847)
+      if (--pending == 0)
+        pthread_cond_broadcast(&done);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// Terminate all worker threads
+static void stopWorkers(void) {
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  pthread_cond_broadcast(&start);
+  pthread_mutex_unlock(&lock);
+  for (int i = 0; i < nworkers; i++)
+    pthread_join(workers[i], NULL);
+  nworkers = 0;
+  quit = 0;
+}
+
+/// Set the number of threads used by PoolParallelFor.
+void PoolSetThreads(int n) { ///
+  if (n == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cpus > 0 ? (int)cpus : 1;
+  }
+  if (n < 1) n = 1;
+  if (n > POOL_MAX_THREADS) n = POOL_MAX_THREADS;
+  if (n - 1 < nworkers)
+    stopWorkers();
+  nthreads = n;
+}
+
+/// Get the number of threads used by PoolParallelFor.
+int PoolThreads(void) { ///
+  return nthreads;
+}
+
+/// Number of bands PoolParallelFor(n, grain, ...) would use.
+int PoolBands(int n, int grain) { ///
+  int bands = n / grain;
+  if (bands > nthreads) bands = nthreads;
+  if (bands < 1 || insideTask) bands = 1;
+  return bands;
+}
+
+/// Run task on contiguous bands covering [0, n), in parallel.
+int PoolParallelFor(int n, int grain, PoolTask task, void* arg) { ///
+  int bands = PoolBands(n, grain);
+  // Start missing workers (if that fails, use fewer bands)
+  spawned = generation;
+  while (nworkers < bands - 1 &&
+         pthread_create(&workers[nworkers], NULL, worker, (void*)(intptr_t)nworkers) == 0)
+    nworkers++;
+  if (bands > nworkers + 1) bands = nworkers + 1;
+
+  if (bands == 1) {
+    task(arg, 0, 0, n);
+    return 1;
+  }
+
+  pthread_mutex_lock(&lock);
+  jobTask = task;
+  jobArg = arg;
+  jobN = n;
+  jobBands = bands;
+  pending = bands - 1;
+  generation++;
+  pthread_cond_broadcast(&start);
+  pthread_mutex_unlock(&lock);
+
+  int lo, hi;
+  bandRange(n, bands, 0, &lo, &hi);
+  insideTask = 1;
+  runBand(task, arg, 0, bands, lo, hi);
+  insideTask = 0;
+
+  pthread_mutex_lock(&lock);
+  while (pending > 0)
+    pthread_cond_wait(&done, &lock);
+  pthread_mutex_unlock(&lock);
+  return bands;
+}
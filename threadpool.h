@@ -0,0 +1,51 @@
+/// threadpool - A small pool of worker threads.
+///
+/// Used internally by the image8bit module to split per-pixel operations
+/// into bands of rows that run in parallel.
+///
+/// Use as follows:
+///
+/// void task(void* arg, int band, int lo, int hi) {
+///   for (int y = lo; y < hi; y++) { ... }  // process rows [lo, hi)
+/// }
+/// ...
+/// PoolSetThreads(4);                // once, or whenever it must change
+/// PoolParallelFor(height, 16, task, &arg);
+///
+/// The split of [0, n) into bands depends only on n, grain and the number
+/// of threads, and each band is processed by exactly one call to task,
+/// so tasks that write disjoint outputs give deterministic results.
+/// While a trace is recorded (see InstrTraceOpen), the bands of parallel
+/// jobs are recorded as spans of the threads that run them.
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/// Maximum number of threads (and of bands in a parallel for)
+#define POOL_MAX_THREADS 256
+
+/// Type of the functions run by PoolParallelFor.
+/// Processes the items [lo, hi) of band number band.
+typedef void (*PoolTask)(void* arg, int band, int lo, int hi);
+
+/// Set the number of threads used by PoolParallelFor (including the
+/// calling thread).  n == 0 selects the number of online processors.
+/// Requires: 0 <= n.  Values above POOL_MAX_THREADS are reduced.
+void PoolSetThreads(int n) ;
+
+/// Get the number of threads used by PoolParallelFor.
+int PoolThreads(void) ;
+
+/// Number of bands PoolParallelFor(n, grain, ...) would use.
+int PoolBands(int n, int grain) ;
+
+/// Run task on contiguous bands covering [0, n), in parallel, and wait
+/// for all of them to finish.
+/// Bands have at least grain items (except when n < grain), so small jobs
+/// run entirely in the calling thread.
+/// Calls made from inside a task run serially in that thread.
+/// Requires: n >= 0, grain >= 1.
+/// Returns the number of bands used.
+int PoolParallelFor(int n, int grain, PoolTask task, void* arg) ;
+
+#endif